@@ -1,12 +1,31 @@
+#define _POSIX_C_SOURCE 200112L /* getopt, isatty, write, pthreads */
+
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define C4 60 /* Tabs support a range C3..B6, C4 is a middle C reference */
 
+/* Note lengths are counted in ticks, a unit note length is TICKS long. Only
+ * the synthesizer and the voice merging care about the rhythm, so the length
+ * of the note being played and of the rests before it are kept aside rather
+ * than passed to every renderer. */
+#define TICKS 48
+static int note_len = TICKS, note_rest;
+
 static char *RST = "\x1b[0m";    /* Normal  style */
 static char *TXT = "\x1b[37m";   /* Text:   white */
 static char *DIM = "\x1b[35m";   /* Dimmed: magenta */
@@ -53,44 +72,585 @@ static void asciify(void) {
   FFS = "*";
 }
 
-#define NLINES 10               /* Max height of a multi-line buffer */
-#define LINESZ 1024             /* Max width of a multi-line buffer */
-static char ln[NLINES][LINESZ]; /* Multiline buffer, global for all renderers */
+#define LINESZ 1024 /* Max width of a multi-line buffer */
+#define ROWSZ (4 * LINESZ) /* Max bytes of a rendered row, markup styles are longer than colors */
 
 struct instr {
   void (*reset)(void *);
   void (*sym)(void *, int);
   void (*note)(void *, int);
+  int (*cost)(void *, int);        /* Difficulty of playing a note, -1 if unplayable */
+  void (*chord)(void *, int, int); /* Chord symbol: root note 0..11 and index in CHORDS */
   void *ctx;
 };
 
-/* Like snprintf, but to append a formatted string */
+static unsigned instr_gen; /* Bumped whenever an instrument is reconfigured */
+
+/* Like snprintf, but to append a formatted string to a row. What doesn't fit
+ * is dropped as a whole, so styles are never cut. */
 static void strcatf(const char *ln, const char *fmt, ...) {
+  char buf[ROWSZ];
   va_list va;
-  int n = strlen(ln);
+  int n = strlen(ln), len;
   va_start(va, fmt);
-  vsnprintf((char *)ln + n, LINESZ - n - 1, fmt, va);
+  len = vsnprintf(buf, sizeof(buf), fmt, va);
   va_end(va);
+  if (len >= 0 && n + len < ROWSZ) strcpy((char *)ln + n, buf);
 }
 
 int isempty(const char *s) { return s[strspn(s, " \n")] == '\0'; }
 
+/* ---------------------------- Output ---------------------------------- */
+
+/* Renderers append to a large output buffer that is written out in big chunks
+ * when it fills up, so that a slow reader on the other side of a pipe costs a
+ * few write() calls instead of stalling the stdio stream on every glyph. */
+#define OUTSZ (64 * 1024)
+struct out {
+  char *buf;
+  size_t len;
+  size_t cap;
+  int fd;  /* Output file, or -1 to grow the buffer in memory */
+  int tty; /* Output is a terminal, flushed after every input line */
+};
+static char outbuf[OUTSZ];
+static struct out stdout_out = {outbuf, 0, OUTSZ, STDOUT_FILENO};
+static struct out *out_cur = &stdout_out;
+
+static void write_all(int fd, const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    ssize_t n = write(fd, s + i, len - i);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    i = i + n;
+  }
+}
+
+/* Output to pipes and files is handed over to a writer thread through a
+ * queue of buffers, so rendering goes on while a slow reader, like a pager,
+ * drains the output. The renderer is the only producer and the writer the
+ * only consumer, the producer waits only when the queue is full. */
+#define NCHUNKS 256 /* Queued buffers, up to 16MB ahead of the reader */
+
+static struct {
+  int fd; /* Output handed over to the thread, -1 if none */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *chunk[NCHUNKS];
+  size_t len[NCHUNKS];
+  unsigned long head, tail; /* Next chunk to write, next chunk to fill */
+  int done;
+} writer = {-1};
+
+static void *writer_run(void *arg) {
+  unsigned long i;
+  (void)arg;
+  pthread_mutex_lock(&writer.lock);
+  for (;;) {
+    while (writer.head == writer.tail && !writer.done) {
+      pthread_cond_wait(&writer.cond, &writer.lock);
+    }
+    if (writer.head == writer.tail) break;
+    i = writer.head % NCHUNKS;
+    pthread_mutex_unlock(&writer.lock);
+    write_all(writer.fd, writer.chunk[i], writer.len[i]);
+    pthread_mutex_lock(&writer.lock);
+    writer.head++;
+    pthread_cond_signal(&writer.cond);
+  }
+  pthread_mutex_unlock(&writer.lock);
+  return NULL;
+}
+
+static void writer_start(int fd) {
+  pthread_mutex_init(&writer.lock, NULL);
+  pthread_cond_init(&writer.cond, NULL);
+  writer.fd = fd;
+  if (pthread_create(&writer.thread, NULL, writer_run, NULL) != 0) writer.fd = -1;
+}
+
+/* Queue a copy of the data, chunks are owned by the producer until queued */
+static void writer_put(const char *s, size_t len) {
+  while (len > 0) {
+    unsigned long i = writer.tail % NCHUNKS;
+    size_t n = len < OUTSZ ? len : OUTSZ;
+    pthread_mutex_lock(&writer.lock);
+    while (writer.tail - writer.head == NCHUNKS) pthread_cond_wait(&writer.cond, &writer.lock);
+    pthread_mutex_unlock(&writer.lock);
+    if (writer.chunk[i] == NULL && (writer.chunk[i] = malloc(OUTSZ)) == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    memcpy(writer.chunk[i], s, n);
+    writer.len[i] = n;
+    pthread_mutex_lock(&writer.lock);
+    writer.tail++;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+    s += n;
+    len -= n;
+  }
+}
+
+/* Wait until everything queued is written */
+static void writer_stop(void) {
+  if (writer.fd < 0) return;
+  pthread_mutex_lock(&writer.lock);
+  writer.done = 1;
+  pthread_cond_signal(&writer.cond);
+  pthread_mutex_unlock(&writer.lock);
+  pthread_join(writer.thread, NULL);
+  writer.fd = -1;
+}
+
+static void out_write(int fd, const char *s, size_t len) {
+  if (fd == writer.fd) {
+    writer_put(s, len);
+  } else {
+    write_all(fd, s, len);
+  }
+}
+
+/* ------------------------ HTML and SVG output -------------------------- */
+
+/* In HTML and SVG the renderers emit markup: styles are span tags with shared
+ * CSS classes and glyphs are escaped, so HTML is written out as is. Every
+ * style closes the current span and opens the next one, exactly one span is
+ * open anywhere in the document and rows may be cut between any two tags.
+ * SVG has no line breaks, so lines are split into text elements as they are
+ * written, reopening the current span, and the size of the picture is
+ * counted along. The body is kept in a temporary file until the size is known
+ * for the root element. */
+enum { ANSI, HTML, SVG };
+static int format = ANSI;
+
+static struct {
+  FILE *body;    /* SVG text elements, written out at the end */
+  char open[32]; /* Open span, reopened on every line */
+  int line;      /* Number of lines written */
+  int col;       /* Columns in the current line */
+  int width;     /* Columns in the longest line */
+} markup;
+
+static const char *CSS =
+    ".t{fill:#ccc;color:#ccc}.d{fill:#a4a;color:#a4a}.a{fill:#cb0;color:#cb0;font-weight:bold}"
+    ".e{fill:#c33;color:#c33}";
+
+/* Split SVG markup into lines of text elements. Styles and entities are
+ * written with single out() calls, so they are never split between writes. */
+static void markup_write(int fd, const char *s, size_t n) {
+  size_t i, j, k;
+  const char *end;
+  if (format != SVG) {
+    out_write(fd, s, n);
+    return;
+  }
+  for (i = 0; i < n; i = k) {
+    for (j = i; j < n && s[j] != '<' && s[j] != '&' && s[j] != '\n'; j++) {
+      markup.col += (s[j] & 0xc0) != 0x80;
+    }
+    fwrite(s + i, 1, j - i, markup.body);
+    if (j == n) break;
+    if (s[j] == '\n') {
+      if (markup.col > markup.width) markup.width = markup.col;
+      markup.col = 0;
+      markup.line++;
+      fprintf(markup.body, "</tspan></text>\n<text x=\"0\" y=\"%.1fem\" xml:space=\"preserve\">%s",
+              (markup.line + 1) * 1.2, markup.open);
+      k = j + 1;
+      continue;
+    }
+    end = memchr(s + j, s[j] == '<' ? '>' : ';', n - j);
+    k = end ? (size_t)(end - s) + 1 : n;
+    if (s[j] == '&') {
+      markup.col++;
+    } else if (s[j + 1] != '/' && k - j < sizeof(markup.open)) {
+      memcpy(markup.open, s + j, k - j); /* Reopened on the next line */
+      markup.open[k - j] = 0;
+    }
+    fwrite(s + j, 1, k - j, markup.body);
+  }
+}
+
+/* Length of a rendered string cut to n bytes. Markup is not cut inside a tag
+ * or an entity, nor between the closing and the opening tag of a style. */
+static int markup_cut(const char *s, int n) {
+  int i = n, j;
+  if (format == ANSI) return n;
+  for (j = n; j > 0 && s[j - 1] != '>' && s[j - 1] != ';'; j--) {
+    if (s[j - 1] == '<' || s[j - 1] == '&') {
+      i = j - 1;
+      break;
+    }
+  }
+  if (i > 0 && s[i - 1] == '>') {
+    for (j = i - 1; j > 0 && s[j] != '<'; j--);
+    if (s[j] == '<' && s[j + 1] == '/') i = j;
+  }
+  return i;
+}
+
+static void out_flush(void) {
+  if (out_cur->fd < 0) return;
+  if (format == ANSI) {
+    out_write(out_cur->fd, out_cur->buf, out_cur->len);
+  } else {
+    markup_write(out_cur->fd, out_cur->buf, out_cur->len);
+  }
+  out_cur->len = 0;
+}
+
+/* Make sure there is room for n more bytes in the output buffer */
+static void out_reserve(size_t n) {
+  struct out *o = out_cur;
+  if (o->len + n < o->cap) return;
+  if (o->fd >= 0) {
+    out_flush();
+    return;
+  }
+  while (o->len + n >= o->cap) o->cap = o->cap ? o->cap * 2 : OUTSZ;
+  if ((o->buf = realloc(o->buf, o->cap)) == NULL) {
+    perror("realloc");
+    exit(1);
+  }
+}
+
+static void out(const char *s, size_t n) {
+  out_reserve(n);
+  if (out_cur->len + n >= out_cur->cap) {
+    /* Too large to be buffered */
+    if (format == ANSI) {
+      out_write(out_cur->fd, s, n);
+    } else {
+      markup_write(out_cur->fd, s, n);
+    }
+    return;
+  }
+  memcpy(out_cur->buf + out_cur->len, s, n);
+  out_cur->len += n;
+}
+
+static void outs(const char *s) { out(s, strlen(s)); }
+
+/* Print a rendered row */
+static void outrow(const char *s) {
+  outs(INDENT);
+  outs(s);
+  out("\n", 1);
+}
+
+/* Print text of the input, like lyrics or titles, escaped in markup */
+static void outtext(const char *s, size_t n) {
+  const char *p, *end = s + n;
+  for (; format != ANSI && (p = s + strcspn(s, "<>&")) < end; s = p + 1) {
+    out(s, p - s);
+    outs(*p == '<' ? "&lt;" : *p == '>' ? "&gt;" : "&amp;");
+  }
+  out(s, end - s);
+}
+
+static void outf(const char *fmt, ...) {
+  va_list va;
+  int n;
+  char *tmp;
+  out_reserve(2 * LINESZ);
+  va_start(va, fmt);
+  n = vsnprintf(out_cur->buf + out_cur->len, out_cur->cap - out_cur->len, fmt, va);
+  va_end(va);
+  if (n <= 0) return;
+  if ((size_t)n < out_cur->cap - out_cur->len) {
+    out_cur->len += n;
+    return;
+  }
+  /* Too long for the reserve, format it aside */
+  if ((tmp = malloc(n + 1)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  va_start(va, fmt);
+  vsnprintf(tmp, n + 1, fmt, va);
+  va_end(va);
+  out(tmp, n);
+  free(tmp);
+}
+
+/* ----------------------------- Rows ----------------------------------- */
+
+/* Rows of a multi-line tab, one per string or hole, sized from the
+ * instrument. Rows are stored one after another in a single buffer and their
+ * lengths are kept aside, so appending a note to every row never rescans
+ * them. Like strcatf, rows are silently cut at ROWSZ. */
+struct rows {
+  int n;     /* Number of rows */
+  char *buf; /* n rows of ROWSZ bytes each */
+  int *len;  /* Length of every row */
+};
+
+static void *xrealloc(void *p, size_t n) {
+  if ((p = realloc(p, n)) == NULL) {
+    perror("realloc");
+    exit(1);
+  }
+  return p;
+}
+
+static char *row(struct rows *r, int i) { return r->buf + (size_t)i * ROWSZ; }
+
+/* Clear all rows, returns 1 if the storage had to be (re)allocated */
+static int rows_init(struct rows *r, int n) {
+  int i, alloc = r->buf == NULL || r->n != n;
+  if (alloc) {
+    r->n = n;
+    r->buf = xrealloc(r->buf, (size_t)n * ROWSZ);
+    r->len = xrealloc(r->len, n * sizeof(int));
+  }
+  for (i = 0; i < n; i++) {
+    r->len[i] = 0;
+    r->buf[(size_t)i * ROWSZ] = 0;
+  }
+  return alloc;
+}
+
+/* Markup style a rendered string starts with, or NULL */
+static const char *markup_style(const char *s, int n) {
+  const char *styles[5];
+  int i, len;
+  styles[0] = TXT;
+  styles[1] = DIM;
+  styles[2] = ACC;
+  styles[3] = ERR;
+  styles[4] = RST;
+  for (i = 0; i < 5; i++) {
+    len = strlen(styles[i]);
+    if (len && len <= n && memcmp(s, styles[i], len) == 0) return styles[i];
+  }
+  return NULL;
+}
+
+/* The last markup style of a row, each one is a closing and an opening tag */
+static char *row_style(char *p, int len, const char **style) {
+  char *q = p + len;
+  int tags = 0;
+  while (q > p && tags < 2) tags += *--q == '<';
+  if (tags < 2 || (*style = markup_style(q, p + len - q)) == NULL) return NULL;
+  return q;
+}
+
+static void row_cat(struct rows *r, int i, const char *s, int n) {
+  char *p = row(r, i), *q;
+  const char *style = format == ANSI ? NULL : markup_style(s, n), *last;
+  int cut;
+  if (r->len[i] >= ROWSZ - 2) return;
+  /* Markup styles are joined as the row grows: a style with nothing after it
+   * is dropped and the open style is not opened again */
+  while (style && (q = row_style(p, r->len[i], &last)) != NULL) {
+    if (q + strlen(last) == p + r->len[i]) {
+      r->len[i] = q - p;
+      *q = 0;
+      continue;
+    }
+    if (last == style) {
+      s = s + strlen(style);
+      n = n - strlen(style);
+    }
+    break;
+  }
+  cut = n > ROWSZ - 2 - r->len[i];
+  if (cut) n = markup_cut(s, ROWSZ - 2 - r->len[i]);
+  memcpy(p + r->len[i], s, n);
+  p[r->len[i] + n] = 0;
+  r->len[i] = cut ? ROWSZ - 2 : r->len[i] + n; /* A cut row takes nothing more */
+}
+
+static void row_catf(struct rows *r, int i, const char *fmt, ...) {
+  char buf[LINESZ];
+  va_list va;
+  int n;
+  va_start(va, fmt);
+  n = vsnprintf(buf, sizeof(buf), fmt, va);
+  va_end(va);
+  row_cat(r, i, buf, n < LINESZ ? n : LINESZ - 1);
+}
+
+/* Append the same formatted string to every row */
+static void rows_catf(struct rows *r, const char *fmt, ...) {
+  char buf[LINESZ];
+  va_list va;
+  int i, n;
+  va_start(va, fmt);
+  n = vsnprintf(buf, sizeof(buf), fmt, va);
+  va_end(va);
+  if (n >= LINESZ) n = LINESZ - 1;
+  for (i = 0; i < r->n; i++) row_cat(r, i, buf, n);
+}
+
+static void rows_out(struct rows *r) {
+  int i;
+  for (i = 0; i < r->n; i++) outrow(row(r, i));
+}
+
+/* Styles and glyphs of the markup formats */
+static void markup_styles(void) {
+  if (format == HTML && *RST) {
+    RST = "</span><span>";
+    TXT = "</span><span class=\"t\">";
+    DIM = "</span><span class=\"d\">";
+    ACC = "</span><span class=\"a\">";
+    ERR = "</span><span class=\"e\">";
+  } else if (format == SVG && *RST) {
+    RST = "</tspan><tspan>";
+    TXT = "</tspan><tspan class=\"t\">";
+    DIM = "</tspan><tspan class=\"d\">";
+    ACC = "</tspan><tspan class=\"a\">";
+    ERR = "</tspan><tspan class=\"e\">";
+  }
+  if (strcmp(FL, "<") == 0) FL = "&lt;";
+  if (strcmp(FR, ">") == 0) FR = "&gt;";
+}
+
+/* Markup around the document is written directly, bypassing the line splitting */
+static void markup_begin(void) {
+  char buf[512];
+  if (format == HTML) {
+    sprintf(buf,
+            "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><style>"
+            "body{background:#111}pre{font-family:monospace}%s</style></head>\n<body><pre><span>",
+            CSS);
+    out_write(stdout_out.fd, buf, strlen(buf));
+  } else if (format == SVG) {
+    if ((markup.body = tmpfile()) == NULL) {
+      perror("tmpfile");
+      exit(1);
+    }
+    strcpy(markup.open, "<tspan>");
+    fprintf(markup.body, "<text x=\"0\" y=\"1.2em\" xml:space=\"preserve\">%s", markup.open);
+  }
+}
+
+/* Monospace glyphs are about 0.6em wide, lines are 1.2em apart */
+#define SVGFONT 14
+static void out_close(void) {
+  char buf[512];
+  size_t n;
+  out_flush();
+  if (format == HTML) {
+    sprintf(buf, "</span></pre></body></html>\n");
+  } else if (format == SVG) {
+    double w = (markup.width > markup.col ? markup.width : markup.col) * 0.6 * SVGFONT;
+    double h = (markup.line + 1.3) * 1.2 * SVGFONT;
+    fputs("</tspan></text>\n", markup.body);
+    sprintf(buf,
+            "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%.0f\" height=\"%.0f\" "
+            "viewBox=\"0 0 %.0f %.0f\" font-family=\"monospace\" font-size=\"%d\">"
+            "<style>svg{background:#111}text{white-space:pre}%s</style>\n",
+            w, h, w, h, SVGFONT, CSS);
+    out_write(stdout_out.fd, buf, strlen(buf));
+    rewind(markup.body);
+    while ((n = fread(buf, 1, sizeof(buf), markup.body)) > 0) out_write(stdout_out.fd, buf, n);
+    fclose(markup.body);
+    sprintf(buf, "</svg>\n");
+  } else {
+    buf[0] = 0;
+  }
+  out_write(stdout_out.fd, buf, strlen(buf));
+  writer_stop();
+}
+
+/* Number of terminal columns in a rendered string, markup tags take none and
+ * entities take one */
+static int width(const char *s) {
+  int w = 0;
+  for (; *s; s++) {
+    if (*s == '\x1b' || (*s == '<' && format != ANSI)) {
+      s = s + strcspn(s, *s == '<' ? ">" : "m");
+      if (!*s) break;
+    } else if (*s == '&' && format != ANSI) {
+      s = s + strcspn(s, ";");
+      w++;
+      if (!*s) break;
+    } else if ((*s & 0xc0) != 0x80) {
+      w++;
+    }
+  }
+  return w;
+}
+
+/* -------------------------- Chord symbols ---------------------------- */
+
+static const char *NOTES[] = {"C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab", "A", "Bb", "B"};
+
+static struct {
+  const char *name;
+  int n;
+  int tones[4]; /* Semitones above the root, most important first */
+} CHORDS[] = {
+    {"", 3, {0, 4, 7}},         {"m", 3, {0, 3, 7}},        {"7", 4, {0, 4, 10, 7}},
+    {"m7", 4, {0, 3, 10, 7}},   {"maj7", 4, {0, 4, 11, 7}}, {"6", 4, {0, 4, 9, 7}},
+    {"m6", 4, {0, 3, 9, 7}},    {"9", 4, {0, 4, 10, 2}},    {"dim", 3, {0, 3, 6}},
+    {"dim7", 4, {0, 3, 6, 9}},  {"m7b5", 4, {0, 3, 6, 10}}, {"aug", 3, {0, 4, 8}},
+    {"sus2", 3, {0, 2, 7}},     {"sus4", 3, {0, 5, 7}},     {"5", 2, {0, 7}},
+};
+#define NCHORDS (int)(sizeof(CHORDS) / sizeof(CHORDS[0]))
+
+/* Other common spellings of chord qualities */
+static const char *CHORD_ALIASES[] = {"min", "m", "mi", "m", "-", "m", "maj", "", "M", "",
+                                      "M7", "maj7", "+", "aug", "o", "dim", "sus", "sus4",
+                                      "min7", "m7", "-7", "m7", "o7", "dim7", NULL};
+
+/* Parse a chord symbol like "Am", "F#7" or "Bb/D", returns quality or -1 */
+static int chord_parse(const char *s, size_t len, int *root) {
+  const int N[] = {9, 11, 0, 2, 4, 5, 7};
+  char q[16];
+  int i;
+  if (len == 0 || *s < 'A' || *s > 'G') return -1;
+  *root = N[*s - 'A'];
+  for (s++, len--; len > 0 && (*s == '#' || *s == 'b'); s++, len--) {
+    *root = (*root + (*s == '#' ? 1 : 11)) % 12;
+  }
+  len = len < strcspn(s, "/\"") ? len : strcspn(s, "/\""); /* Bass notes are ignored */
+  if (len >= sizeof(q)) return -1;
+  memcpy(q, s, len);
+  q[len] = 0;
+  for (i = 0; CHORD_ALIASES[i]; i += 2) {
+    if (strcmp(q, CHORD_ALIASES[i]) == 0) strcpy(q, CHORD_ALIASES[i + 1]);
+  }
+  for (i = 0; i < NCHORDS; i++) {
+    if (strcmp(q, CHORDS[i].name) == 0) return i;
+  }
+  return -1;
+}
+
 /* ------------------- String fretted instruments ------------------------- */
 struct frets {
-  int n;             /* Number of strings */
-  char *tuning;      /* One letter per string */
-  char *frets;       /* Fret labels, e.g. 0 1 2 3 4 5 6 7..., optional */
-  int roots[NLINES]; /* Note numbers for each open string */
+  int n;            /* Number of strings */
+  char *tuning;     /* One letter per string */
+  char *frets;      /* Fret labels, e.g. 0 1 2 3 4 5 6 7..., optional */
+  const int *roots; /* Note numbers for each open string */
+  int capo;         /* Fret of the capo, already added to the roots */
+  int tuned;        /* Roots and tuning were allocated by frets_tune */
   int hasnotes;
+  int chord;          /* Inside a chord notes are collected per string */
+  int lost;           /* A chord note found no string, its column is marked */
+  char (*cell)[8];    /* Fret labels of a chord per string, "x" if unplayable */
+  char names[ROWSZ];  /* Chord symbols, aligned to the chord columns */
+  signed char *shapes; /* Chord fingerings, n strings per root and quality, -1 for muted */
+  struct rows rows;
 };
 
 static void frets_reset(void *ctx) {
   int i;
   struct frets *f = (struct frets *)ctx;
-  f->hasnotes = 0;
-  for (i = 0; i < f->n; i++) {
-    snprintf(ln[i], LINESZ - 1, "%s%c%s-%s", DIM, f->tuning[i], VLINE, RST);
+  if (rows_init(&f->rows, f->n)) {
+    f->cell = xrealloc(f->cell, f->n * sizeof(f->cell[0]));
+    memset(f->cell, 0, f->n * sizeof(f->cell[0]));
+    free(f->shapes);
+    f->shapes = NULL;
   }
+  f->hasnotes = 0;
+  f->names[0] = 0;
+  for (i = 0; i < f->n; i++) row_catf(&f->rows, i, "%s%c%s-%s", DIM, f->tuning[i], VLINE, RST);
 }
 
 static void frets_sym(void *ctx, int c) {
@@ -98,84 +658,386 @@ static void frets_sym(void *ctx, int c) {
   struct frets *f = (struct frets *)ctx;
   if (c == '\n') {
     if (f->hasnotes) {
-      for (i = 0; i < f->n; i++) { printf("%s%s\n", INDENT, ln[i]); }
+      if (f->names[0]) outrow(f->names);
+      rows_out(&f->rows);
       frets_reset(f);
     }
   } else if (c == ' ') {
-    for (i = 0; i < f->n; i++) { strcatf(ln[i], "%s--%s", DIM, RST); }
+    rows_catf(&f->rows, "%s--%s", DIM, RST);
   } else if (c == '|') {
-    for (i = 0; i < f->n; i++) { strcatf(ln[i], "%s%s-%s", DIM, VLINE, RST); }
+    rows_catf(&f->rows, "%s%s-%s", DIM, VLINE, RST);
+  } else if (c == '[') {
+    f->chord = 1;
+    f->lost = 0;
+    memset(f->cell, 0, f->n * sizeof(f->cell[0]));
+  } else if (c == ']' && f->chord) {
+    /* All chord notes share a column as wide as the longest fret label */
+    int w = 0;
+    f->chord = 0;
+    if (f->lost) {
+      /* More notes than strings, the column is marked above the tab */
+      int pad = width(row(&f->rows, 0)) - width(f->names);
+      strcatf(f->names, "%*s%sx%s", pad > 0 ? pad : 1, "", ERR, RST);
+    }
+    for (i = 0; i < f->n; i++) {
+      if ((int)strlen(f->cell[i]) > w) w = strlen(f->cell[i]);
+    }
+    for (i = 0; w && i < f->n; i++) {
+      int len = strlen(f->cell[i]);
+      if (len) {
+        row_catf(&f->rows, i, "%s%s%s%.*s-%s", strcmp(f->cell[i], "x") ? ACC : ERR, f->cell[i],
+                 DIM, w - len, "--------", RST);
+      } else {
+        row_catf(&f->rows, i, "%s%.*s-%s", DIM, w, "--------", RST);
+      }
+    }
   }
 }
 
-static void frets_note(void *ctx, int n) {
-  int i;
-  struct frets *f = (struct frets *)ctx;
-  int index = -1;
-  int fret = -1;
-  f->hasnotes = 1;
+/* Find the string with the lowest fret for the note, returns string index */
+static int frets_find(struct frets *f, int n, int *fret) {
+  int i, index = -1;
+  *fret = -1;
   for (i = 0; i < f->n; i++) {
     int j = n - f->roots[i];
-    if (j >= 0 && (fret == -1 || j <= fret)) {
+    if (f->chord && f->cell[i][0]) continue; /* String is taken by another chord note */
+    if (j >= 0 && (*fret == -1 || j <= *fret)) {
       index = i;
-      fret = j;
+      *fret = j;
     }
   }
-  if (index == -1) {
-    for (i = 0; i < f->n; i++) { strcatf(ln[i], "%sx%s-%s", ERR, DIM, RST); }
-  } else {
-    char fretsym[LINESZ] = {0};
-    if (f->frets) {
-      char labels[LINESZ], *c, *p;
-      strncpy(labels, f->frets, LINESZ - 1);
-      for (c = p = labels; *c; c++) {
-        if (*c == ' ') {
-          *c = 0;
-          if (fret-- == 0) {
-            strncpy(fretsym, p, LINESZ - 1);
-            break;
-          }
-          p = c + 1;
-        }
+  return index;
+}
+
+/* Label of a fret, empty if the instrument has no such fret. Labels are
+ * space-terminated. */
+static void frets_label(struct frets *f, int fret, char *label, size_t sz) {
+  const char *p, *e;
+  label[0] = 0;
+  if (f->frets == NULL) {
+    snprintf(label, sz, "%d", fret);
+    return;
+  }
+  for (p = f->frets; (e = strchr(p, ' ')) != NULL; p = e + 1) {
+    if (fret-- == 0) {
+      snprintf(label, sz, "%.*s", (int)(e - p), p);
+      return;
+    }
+  }
+}
+
+static int frets_cost(void *ctx, int n) {
+  int fret;
+  char label[8];
+  struct frets *f = (struct frets *)ctx;
+  if (frets_find(f, n, &fret) < 0) return -1;
+  frets_label(f, fret, label, sizeof(label));
+  return label[0] ? fret : -1;
+}
+
+static void frets_note(void *ctx, int n) {
+  int i, len, celllen;
+  struct frets *f = (struct frets *)ctx;
+  int fret;
+  int index = frets_find(f, n, &fret);
+  char fretsym[LINESZ] = {0};
+  char line[64], cell[LINESZ];
+  f->hasnotes = 1;
+  if (index != -1) frets_label(f, fret, fretsym, sizeof(fretsym));
+  if (f->chord) {
+    if (index == -1) {
+      /* Below all strings or no string left, shown on the lowest free string */
+      for (i = f->n - 1; i >= 0 && f->cell[i][0]; i--);
+      if (i < 0) {
+        f->lost = 1;
+        return;
       }
-    } else {
-      snprintf(fretsym, LINESZ - 1, "%d", fret);
+      index = i;
+      fretsym[0] = 0;
     }
+    snprintf(f->cell[index], sizeof(f->cell[0]), "%s", fretsym[0] ? fretsym : "x");
+  } else if (index == -1) {
+    rows_catf(&f->rows, "%sx%s-%s", ERR, DIM, RST);
+  } else {
+    /* Every string but one gets the same line */
+    len = sprintf(line, "%s%s%s", DIM, strlen(fretsym) == 1 ? "--" : "---", RST);
+    celllen = snprintf(cell, sizeof(cell), fretsym[0] ? "%s%s%s-%s" : "%sx%s-%s",
+                       fretsym[0] ? ACC : ERR, fretsym, DIM, RST);
+    if (celllen >= LINESZ) celllen = LINESZ - 1;
     for (i = 0; i < f->n; i++) {
       if (index != i) {
-        strcatf(ln[i], "%s%s%s", DIM, strlen(fretsym) == 1 ? "--" : "---", RST);
-      } else if (fretsym[0]) {
-        strcatf(ln[i], "%s%s%s-%s", ACC, fretsym, DIM, RST);
+        row_cat(&f->rows, i, line, len);
       } else {
-        strcatf(ln[i], "%sx%s-%s", ERR, fretsym, DIM, RST);
+        row_cat(&f->rows, i, cell, celllen);
+      }
+    }
+  }
+}
+
+/* Penalty of a chord fingering, the lower the easier to play */
+static int frets_score(struct frets *f, signed char *shape, int root, int quality) {
+  int i, j, n, score = 0, bass = -1, lo = -1, hi = 0, fingers = 0, covered = 0, gap = 0;
+  for (i = 0; i < f->n; i++) {
+    if (shape[i] < 0) {
+      /* Muting the bass strings is common, muting the higher ones is not */
+      for (j = 0, score += 3; j < f->n; j++) score += 2 * (f->roots[j] < f->roots[i]);
+      gap = gap || (i > 0 && shape[i - 1] >= 0);
+      continue;
+    }
+    if (gap) score += 10; /* Muted string between ringing ones */
+    n = f->roots[i] + shape[i];
+    if (bass < 0 || n < f->roots[bass] + shape[bass]) bass = i;
+    for (j = 0; j < CHORDS[quality].n; j++) {
+      if ((n - root - CHORDS[quality].tones[j]) % 12 == 0) covered |= 1 << j;
+    }
+    if (shape[i] > 0) {
+      fingers++;
+      if (lo < 0 || shape[i] < lo) lo = shape[i];
+      if (shape[i] > hi) hi = shape[i];
+    }
+  }
+  if (bass < 0) return 1000;
+  for (j = 0; j < CHORDS[quality].n; j++) {
+    if (!(covered & (1 << j))) score += j < 2 ? 50 : 10;
+  }
+  if ((f->roots[bass] + shape[bass] - root) % 12 != 0) score += 4;
+  if (fingers > 4) score += 50;
+  if (lo > 0) score += 2 * lo + 2 * (hi - lo);
+  return score;
+}
+
+#define CHORDSTRINGS 8 /* Max strings to search chord fingerings for */
+
+/* Part of the penalty that only grows as strings are added: mutes, gaps,
+ * fingers and the position. It bounds the score of any fingering that starts
+ * with the first n strings of the shape. */
+static int frets_bound(struct frets *f, signed char *shape, int n) {
+  int i, j, score = 0, hi = 0, fingers = 0, gap = 0;
+  for (i = 0; i < n; i++) {
+    if (shape[i] < 0) {
+      for (j = 0, score += 3; j < f->n; j++) score += 2 * (f->roots[j] < f->roots[i]);
+      gap = gap || (i > 0 && shape[i - 1] >= 0);
+      continue;
+    }
+    if (gap) score += 10;
+    if (shape[i] > 0) fingers++;
+    if (shape[i] > hi) hi = shape[i];
+  }
+  return score + (fingers > 4 ? 50 : 0) + 2 * hi;
+}
+
+/* Try all fingerings with frets in a 4-fret window starting at pos, skipping
+ * the ones that can't beat the best so far */
+static void frets_search(struct frets *f, int i, int pos, int root, int quality,
+                         signed char *shape, signed char *best, int *bestscore) {
+  int fret, j, score;
+  if (i > 0 && frets_bound(f, shape, i) >= *bestscore) return;
+  if (i == f->n) {
+    if ((score = frets_score(f, shape, root, quality)) < *bestscore) {
+      *bestscore = score;
+      memcpy(best, shape, f->n);
+    }
+    return;
+  }
+  shape[i] = -1;
+  frets_search(f, i + 1, pos, root, quality, shape, best, bestscore);
+  for (fret = 0; fret < pos + 4; fret = fret ? fret + 1 : pos) {
+    for (j = 0; j < CHORDS[quality].n; j++) {
+      if ((f->roots[i] + fret - root - CHORDS[quality].tones[j]) % 12 == 0) {
+        shape[i] = fret;
+        frets_search(f, i + 1, pos, root, quality, shape, best, bestscore);
+        break;
+      }
+    }
+  }
+}
+
+/* Build the chord dictionary of the instrument: all roots and qualities */
+static void frets_shapes(struct frets *f) {
+  int root, quality, pos, score;
+  signed char *shape = xrealloc(NULL, f->n), *best;
+  f->shapes = xrealloc(NULL, 12 * NCHORDS * f->n);
+  for (root = 0; root < 12; root++) {
+    for (quality = 0; quality < NCHORDS; quality++) {
+      best = f->shapes + (root * NCHORDS + quality) * f->n;
+      memset(best, -1, f->n);
+      for (pos = 1, score = 1000; pos < 10; pos++) {
+        frets_search(f, 0, pos, root + 120, quality, shape, best, &score);
       }
     }
   }
+  free(shape);
+}
+
+static void frets_chord(void *ctx, int root, int quality) {
+  int i;
+  struct frets *f = (struct frets *)ctx;
+  signed char *shape;
+  static int warned;
+  int pad = width(row(&f->rows, 0)) - width(f->names);
+  strcatf(f->names, "%*s%s%s%s%s", pad > 0 ? pad : 1, "", TXT, NOTES[root], CHORDS[quality].name,
+          RST);
+  if (f->n > CHORDSTRINGS) {
+    /* The fingering search grows exponentially with strings, only names are shown */
+    if (!warned++) fprintf(stderr, "tab: no chord fingerings above %d strings\n", CHORDSTRINGS);
+    f->hasnotes = 1;
+    return;
+  }
+  if (f->shapes == NULL) frets_shapes(f);
+  shape = f->shapes + (root * NCHORDS + quality) * f->n;
+  frets_sym(f, '[');
+  for (i = 0; i < f->n; i++) {
+    if (shape[i] < 0) continue;
+    frets_label(f, shape[i], f->cell[i], sizeof(f->cell[0]));
+    if (!f->cell[i][0]) strcpy(f->cell[i], "x");
+  }
+  frets_sym(f, ']');
+  f->hasnotes = 1;
 }
 
 /* TODO: support diatonic instruments: canjo, Seagull Guitar */
 /* TODO: 5-string banjo */
 /* TODO: Balalaika */
 
-struct frets frets_diddley = {1, "C", NULL, {C4}, 0};
-struct frets frets_gd = {2, "gD", NULL, {C4 + 7, C4 + 2}, 0};
-struct frets frets_gc = {2, "gD", NULL, {C4 + 7, C4}, 0};
-struct frets frets_cbg = {3, "gDG", NULL, {C4 + 7, C4 + 2, C4 - 5}, 0};
-struct frets frets_uke = {4, "AECg", NULL, {C4 + 9, C4 + 4, C4, C4 + 7}, 0};
-struct frets frets_mandolin = {4, "EADG", NULL, {C4 + 16, C4 + 9, C4 + 2, C4 - 5}, 0};
-struct frets frets_guitar = {
-    6, "eBGDAE", NULL, {C4 + 16, C4 + 11, C4 + 7, C4 + 2, C4 - 3, C4 - 8}, 0};
-struct frets frets_violin = {
-    4, "EADG", "0 L1 1 L2 2 3 H3 4 H4", {C4 + 16, C4 + 9, C4 + 2, C4 - 5}, 0};
-
-static struct instr diddley = {frets_reset, frets_sym, frets_note, &frets_diddley};
-static struct instr gd = {frets_reset, frets_sym, frets_note, &frets_gd};
-static struct instr gc = {frets_reset, frets_sym, frets_note, &frets_gc};
-static struct instr cbg = {frets_reset, frets_sym, frets_note, &frets_cbg};
-static struct instr uke = {frets_reset, frets_sym, frets_note, &frets_uke};
-static struct instr mandolin = {frets_reset, frets_sym, frets_note, &frets_mandolin};
-static struct instr guitar = {frets_reset, frets_sym, frets_note, &frets_guitar};
-static struct instr violin = {frets_reset, frets_sym, frets_note, &frets_violin};
+static const int DIDDLEY[] = {C4};
+static const int GD[] = {C4 + 7, C4 + 2};
+static const int GC[] = {C4 + 7, C4};
+static const int CBG[] = {C4 + 7, C4 + 2, C4 - 5};
+static const int UKE[] = {C4 + 9, C4 + 4, C4, C4 + 7};
+static const int GDAE[] = {C4 + 16, C4 + 9, C4 + 2, C4 - 5};
+static const int GUITAR[] = {C4 + 16, C4 + 11, C4 + 7, C4 + 2, C4 - 3, C4 - 8};
+static const int KORA[] = {C4 + 24, C4 + 21, C4 + 19, C4 + 17, C4 + 16, C4 + 14, C4 + 12,
+                           C4 + 10, C4 + 9,  C4 + 7,  C4 + 5,  C4 + 4,  C4 + 2,  C4,
+                           C4 - 2,  C4 - 3,  C4 - 5,  C4 - 8,  C4 - 10, C4 - 12, C4 - 19};
+
+struct frets frets_diddley = {1, "C", NULL, DIDDLEY};
+struct frets frets_gd = {2, "gD", NULL, GD};
+struct frets frets_gc = {2, "gD", NULL, GC};
+struct frets frets_cbg = {3, "gDG", NULL, CBG};
+struct frets frets_uke = {4, "AECg", NULL, UKE};
+struct frets frets_mandolin = {4, "EADG", NULL, GDAE};
+struct frets frets_guitar = {6, "eBGDAE", NULL, GUITAR};
+struct frets frets_violin = {4, "EADG", "0 L1 1 L2 2 3 H3 4 H4", GDAE};
+/* Open strings only, in F major from F2 to C6 */
+struct frets frets_kora = {21, "cagfedcBAGFEDCBAGEDCF", "0 ", KORA};
+
+static struct instr diddley = {frets_reset, frets_sym, frets_note,
+                               frets_cost, frets_chord, &frets_diddley};
+static struct instr gd = {frets_reset, frets_sym, frets_note, frets_cost, frets_chord, &frets_gd};
+static struct instr gc = {frets_reset, frets_sym, frets_note, frets_cost, frets_chord, &frets_gc};
+static struct instr cbg = {frets_reset, frets_sym, frets_note, frets_cost, frets_chord, &frets_cbg};
+static struct instr uke = {frets_reset, frets_sym, frets_note, frets_cost, frets_chord, &frets_uke};
+static struct instr mandolin = {frets_reset, frets_sym, frets_note,
+                                frets_cost, frets_chord, &frets_mandolin};
+static struct instr guitar = {frets_reset, frets_sym, frets_note,
+                              frets_cost, frets_chord, &frets_guitar};
+static struct instr violin = {frets_reset, frets_sym, frets_note,
+                              frets_cost, frets_chord, &frets_violin};
+static struct instr kora = {frets_reset, frets_sym, frets_note, frets_cost, NULL, &frets_kora};
+
+/* Known tunings, to read ASCII tabs */
+static struct frets *FRETS[] = {&frets_guitar, &frets_uke,  &frets_mandolin, &frets_cbg,
+                                &frets_gd,     &frets_kora, &frets_diddley};
+#define NFRETS (int)(sizeof(FRETS) / sizeof(FRETS[0]))
+
+/* Alternate tunings, from the lowest string up like they are usually named */
+#define NSTRINGS 32 /* Max strings of a custom tuning */
+struct tuning {
+  struct frets *f; /* Instrument the tuning is meant for */
+  const char *name;
+  const char *notes;
+};
+
+static const struct tuning TUNINGS[] = {
+    {&frets_guitar, "standard", "EADGBE"},   {&frets_guitar, "dropd", "DADGBE"},
+    {&frets_guitar, "dadgad", "DADGAD"},     {&frets_guitar, "openg", "DGDGBD"},
+    {&frets_guitar, "opend", "DADF#AD"},     {&frets_guitar, "opene", "EBEG#BE"},
+    {&frets_guitar, "opena", "EAEAC#E"},     {&frets_guitar, "openc", "CGCGCE"},
+    {&frets_guitar, "dropc", "CGCFAD"},      {&frets_guitar, "halfdown", "EbAbDbGbBbEb"},
+    {&frets_guitar, "fulldown", "DGCFAD"},   {&frets_uke, "standard", "GCEA"},
+    {&frets_uke, "d", "ADF#B"},              {&frets_uke, "slack", "GCEG"},
+    {&frets_mandolin, "standard", "GDAE"},   {&frets_mandolin, "crossa", "AEAE"},
+    {&frets_mandolin, "sawmill", "GDGD"},    {&frets_violin, "standard", "GDAE"},
+    {&frets_violin, "crossa", "AEAE"},       {&frets_violin, "sawmill", "ADAE"},
+    {&frets_cbg, "standard", "GDG"},         {&frets_cbg, "opend", "DAD"},
+    {&frets_cbg, "opena", "AEA"},            {&frets_cbg, "openg", "GBD"},
+    {&frets_gd, "standard", "DG"},           {&frets_gd, "fifth", "CG"},
+    {&frets_gc, "standard", "CG"},           {&frets_gc, "fourth", "DG"},
+};
+#define NTUNINGS (int)(sizeof(TUNINGS) / sizeof(TUNINGS[0]))
+
+/* Parse notes like "DADGAD" or "EbAbDbGbBbEb" into pitch classes and label
+ * letters, returns the number of strings or -1 */
+static int tuning_parse(const char *s, int *pc, char *letters) {
+  const int N[] = {9, 11, 0, 2, 4, 5, 7};
+  int n = 0;
+  for (; *s; s++, n++) {
+    if (*s < 'A' || *s > 'G' || n == NSTRINGS) return -1;
+    pc[n] = N[*s - 'A'];
+    letters[n] = *s;
+    for (; s[1] == '#' || s[1] == 'b'; s++) pc[n] = (pc[n] + (s[1] == '#' ? 1 : 11)) % 12;
+  }
+  return n ? n : -1;
+}
+
+/* Open string notes of a tuning in the row order (highest string first). With
+ * the same number of strings every string is tuned to the nearest note of its
+ * original tuning, otherwise the lowest string is tuned to the nearest note of
+ * the original lowest string and the others go up from it. */
+static void tuning_roots(struct frets *f, const int *pc, int n, int *roots) {
+  int i, r, d, lo;
+  for (i = 0, lo = f->roots[0]; i < f->n; i++) lo = f->roots[i] < lo ? f->roots[i] : lo;
+  for (i = 0; i < n; i++) {
+    r = n - 1 - i;
+    if (n == f->n) {
+      d = (pc[i] - f->roots[r] + 120) % 12;
+      roots[r] = f->roots[r] + (d > 6 ? d - 12 : d);
+    } else if (i == 0) {
+      d = (pc[i] - lo + 120) % 12;
+      roots[r] = lo + (d > 6 ? d - 12 : d);
+    } else {
+      lo = roots[r + 1];
+      roots[r] = lo + 1 + (pc[i] - lo - 1 + 120) % 12;
+    }
+  }
+}
+
+/* Retune the strings by a catalogue name or notes, NULL keeps the tuning. A
+ * capo raises all open strings, frets are then counted from the capo. */
+static int frets_tune(struct frets *f, const char *tuning, int capo) {
+  int i, n = f->n, pc[NSTRINGS];
+  char letters[NSTRINGS], *labels;
+  int *roots;
+  for (i = 0; tuning && i < NTUNINGS; i++) {
+    if (TUNINGS[i].f == f && strcmp(TUNINGS[i].name, tuning) == 0) tuning = TUNINGS[i].notes;
+  }
+  if (tuning && (n = tuning_parse(tuning, pc, letters)) < 0) return -1;
+  roots = xrealloc(NULL, n * sizeof(int));
+  labels = xrealloc(NULL, n + 1);
+  if (tuning) {
+    tuning_roots(f, pc, n, roots);
+    for (i = 0; i < n; i++) labels[n - 1 - i] = letters[i];
+    labels[n] = 0;
+    if (n > 1 && letters[0] == letters[n - 1]) labels[0] = tolower(letters[n - 1]);
+  } else {
+    memcpy(roots, f->roots, n * sizeof(int));
+    strcpy(labels, f->tuning);
+  }
+  for (i = 0; i < n; i++) roots[i] += capo;
+  if (f->tuned) {
+    free((int *)f->roots);
+    free(f->tuning);
+  }
+  f->tuned = 1;
+  f->roots = roots;
+  f->tuning = labels;
+  f->n = n;
+  f->capo += capo;
+  free(f->shapes); /* Chord fingerings depend on the tuning */
+  f->shapes = NULL;
+  instr_gen++;
+  return 0;
+}
 
 /* -------------- Flutes, Brass, Woodwinds ------------------- */
 
@@ -185,26 +1047,21 @@ struct flute {
   int k;                  /* key of the instrument */
   int r;                  /* range of the instrument in semitones */
   const char *charts[64]; /* All possible fingering charts, each NxW chars */
+  struct rows rows;
 };
 
 static void flute_reset(void *ctx) {
-  int i;
   struct flute *flute = (struct flute *)ctx;
-  for (i = 0; i < flute->n; i++) { ln[i][0] = 0; }
+  rows_init(&flute->rows, flute->n);
 }
 
 static void flute_sym(void *ctx, int c) {
-  int i;
   struct flute *flute = (struct flute *)ctx;
   switch (c) {
-    case ' ':
-      for (i = 0; i < flute->n; i++) strcatf(ln[i], "  ");
-      break;
-    case '|':
-      for (i = 0; i < flute->n; i++) strcatf(ln[i], "%s ", VLINE);
-      break;
+    case ' ': rows_catf(&flute->rows, "  "); break;
+    case '|': rows_catf(&flute->rows, "%s ", VLINE); break;
     case '\n':
-      for (i = 0; i < flute->n; i++) printf("%s%s\n", INDENT, ln[i]);
+      rows_out(&flute->rows);
       flute_reset(ctx);
       break;
   }
@@ -215,33 +1072,44 @@ static void flute_note(void *ctx, int c) {
   struct flute *flute = (struct flute *)ctx;
   const char *fingering;
   if (c < flute->k || c >= flute->k + flute->r) {
-    for (i = 0; i < flute->n; i++) { strcatf(ln[i], "%s%s%s", ERR, "x ", RST); }
+    rows_catf(&flute->rows, "%s%s%s", ERR, "x ", RST);
     return;
   }
 
   fingering = flute->charts[c - flute->k];
   for (i = 0; i < flute->n * flute->w; i++) {
-    char *s = ln[i / flute->w];
+    struct rows *r = &flute->rows;
+    int j = i / flute->w;
     switch (fingering[i]) {
-      case 'B': strcatf(s, "%s%s%s", DIM, FFS, RST); break;
-      case 'X': strcatf(s, "%s%s%s", ACC, FFS, RST); break;
-      case 'O': strcatf(s, "%s%s%s", ACC, FES, RST); break;
-      case 'x': strcatf(s, "%s%s%s", ACC, FF, RST); break;
-      case 'o': strcatf(s, "%s%s%s", ACC, FE, RST); break;
-      case 'l': strcatf(s, "%s%s%s", ACC, FL, RST); break;
-      case 'r': strcatf(s, "%s%s%s", ACC, FR, RST); break;
-      case 'u': strcatf(s, "%s%s%s", ACC, FU, RST); break;
-      case 'b': strcatf(s, "%s%s%s", ACC, FB, RST); break;
-      case 'q': strcatf(s, "%s%s%s", ACC, FQ, RST); break;
-      case 'Q': strcatf(s, "%s%s%s", ACC, FT, RST); break;
-      case 'k': strcatf(s, "%s%s%s", DIM, FO, RST); break;
-      case '+': strcatf(s, "%s%s%s", DIM, FP, RST); break;
-      default:  strcatf(s, "%s%c%s", DIM, fingering[i], RST); break;
+      case 'B': row_catf(r, j, "%s%s%s", DIM, FFS, RST); break;
+      case 'X': row_catf(r, j, "%s%s%s", ACC, FFS, RST); break;
+      case 'O': row_catf(r, j, "%s%s%s", ACC, FES, RST); break;
+      case 'x': row_catf(r, j, "%s%s%s", ACC, FF, RST); break;
+      case 'o': row_catf(r, j, "%s%s%s", ACC, FE, RST); break;
+      case 'l': row_catf(r, j, "%s%s%s", ACC, FL, RST); break;
+      case 'r': row_catf(r, j, "%s%s%s", ACC, FR, RST); break;
+      case 'u': row_catf(r, j, "%s%s%s", ACC, FU, RST); break;
+      case 'b': row_catf(r, j, "%s%s%s", ACC, FB, RST); break;
+      case 'q': row_catf(r, j, "%s%s%s", ACC, FQ, RST); break;
+      case 'Q': row_catf(r, j, "%s%s%s", ACC, FT, RST); break;
+      case 'k': row_catf(r, j, "%s%s%s", DIM, FO, RST); break;
+      case '+': row_catf(r, j, "%s%s%s", DIM, FP, RST); break;
+      default:  row_catf(r, j, "%s%c%s", DIM, fingering[i], RST); break;
     }
-    if (i % flute->w == flute->w - 1) { strcatf(s, " "); }
+    if (i % flute->w == flute->w - 1) row_cat(r, j, " ", 1);
   }
 }
 
+static int flute_cost(void *ctx, int c) {
+  struct flute *flute = (struct flute *)ctx;
+  const char *p;
+  int cost = 0;
+  if (c < flute->k || c >= flute->k + flute->r) return -1;
+  /* Half-holes, side keys and overblowing make a note harder to play */
+  for (p = flute->charts[c - flute->k]; *p; p++) cost += strchr("lrqQbu+", *p) != NULL;
+  return cost;
+}
+
 /*
 TODO: more ocarina types
 TODO: Traverse flute
@@ -588,48 +1456,72 @@ struct flute flute_naf4 = {
     },
 };
 
-struct instr german = {flute_reset, flute_sym, flute_note, &flute_german};
-struct instr baroque = {flute_reset, flute_sym, flute_note, &flute_baroque};
-struct instr tinwhistle = {flute_reset, flute_sym, flute_note, &flute_tinwhistle};
-struct instr xaphoon = {flute_reset, flute_sym, flute_note, &flute_xaphoon};
-struct instr pendant = {flute_reset, flute_sym, flute_note, &flute_pendant};
-struct instr trumpet = {flute_reset, flute_sym, flute_note, &flute_trumpet};
-struct instr sax = {flute_reset, flute_sym, flute_note, &flute_sax};
-struct instr naf = {flute_reset, flute_sym, flute_note, &flute_naf6};
-struct instr naf5 = {flute_reset, flute_sym, flute_note, &flute_naf5};
-struct instr naf4 = {flute_reset, flute_sym, flute_note, &flute_naf4};
+struct instr german = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_german};
+struct instr baroque = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_baroque};
+struct instr tinwhistle = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_tinwhistle};
+struct instr xaphoon = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_xaphoon};
+struct instr pendant = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_pendant};
+struct instr trumpet = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_trumpet};
+struct instr sax = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_sax};
+struct instr naf = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_naf6};
+struct instr naf5 = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_naf5};
+struct instr naf4 = {flute_reset, flute_sym, flute_note, flute_cost, NULL, &flute_naf4};
 
 /* --------------------- Harmonica ----------------------- */
 struct harp {
   int k; /* key */
   int r; /* range in semitones */
   char *layout;
+  int off[64]; /* Offset of every hole label in the layout, zero if not indexed yet */
+  struct rows rows;
 };
-static void harp_reset(void *ctx) {
-  (void)ctx;
-  ln[0][0] = 0;
+
+/* Label of the hole for a note, NULL if the note is out of range */
+static char *harp_hole(struct harp *harp, int c) {
+  int i;
+  if (c < harp->k || c >= harp->k + harp->r) return NULL;
+  if (harp->off[1] == 0) {
+    for (i = 1; i < harp->r; i++) {
+      harp->off[i] = harp->off[i - 1] + strlen(harp->layout + harp->off[i - 1]) + 1;
+    }
+  }
+  return harp->layout + harp->off[c - harp->k];
 }
-static void harp_sym(void *ctx, int c) {
+
+/* Harmonicas in G..B are tuned below C4, harmonicas in Db..F# above */
+static void harp_key(struct harp *harp, int key) {
+  harp->k = C4 + (key <= 6 ? key : key - 12);
+  instr_gen++;
+}
+
+static void harp_reset(void *ctx) { rows_init(&((struct harp *)ctx)->rows, 1); }
+static void harp_sym(void *ctx, int c) {
+  struct rows *r = &((struct harp *)ctx)->rows;
   switch (c) {
-    case ' ': strcatf(ln[0], " "); break;
-    case '|': strcatf(ln[0], "%s%s %s", DIM, VLINE, RST); break;
+    case ' ': row_cat(r, 0, " ", 1); break;
+    case '|': row_catf(r, 0, "%s%s %s", DIM, VLINE, RST); break;
     case '\n':
-      printf("%s%s\n", INDENT, ln[0]);
+      rows_out(r);
       harp_reset(ctx);
       break;
   }
 }
 static void harp_note(void *ctx, int c) {
-  int i;
-  char *p;
   struct harp *harp = (struct harp *)ctx;
-  if (c < harp->k || c >= harp->k + harp->r) {
-    strcatf(ln[0], "%s%s %s", ERR, "x", RST);
+  char *p = harp_hole(harp, c);
+  if (p == NULL) {
+    row_catf(&harp->rows, 0, "%s%s %s", ERR, "x", RST);
     return;
   }
-  p = harp->layout;
-  for (i = c - harp->k; i > 0; i--) { p = p + strlen(p) + 1; }
-  strcatf(ln[0], "%s%s %s", ACC, p, RST);
+  row_catf(&harp->rows, 0, "%s%s %s", ACC, p, RST);
+}
+static int harp_cost(void *ctx, int c) {
+  char *p = harp_hole((struct harp *)ctx, c);
+  int cost = 0;
+  if (p == NULL) return -1;
+  /* Half-step bends are marked with ', whole-step bends and overblows with " */
+  for (; *p; p++) cost += (*p == '\'') + 2 * (*p == '"');
+  return cost;
 }
 struct harp d_harp = {
     C4,
@@ -651,20 +1543,19 @@ struct harp c_harp = {
     /* Octave 6 */
     "+9\0+9^\0-9\0-9^\0+10\0-10\0-10^\0+11\0+11^\0-11\0-11^\0-12\0+12\0+12^",
 };
-struct instr diatonic = {harp_reset, harp_sym, harp_note, &d_harp};
-struct instr chromatic = {harp_reset, harp_sym, harp_note, &c_harp};
+struct instr diatonic = {harp_reset, harp_sym, harp_note, harp_cost, NULL, &d_harp};
+struct instr chromatic = {harp_reset, harp_sym, harp_note, harp_cost, NULL, &c_harp};
 
 /* ---------------------- Jianpu ------------------------- */
 struct jianpu {
   int hasln[3];
+  struct rows rows;
 };
 static void jianpu_reset(void *ctx) {
   int i;
   struct jianpu *jianpu = (struct jianpu *)ctx;
-  for (i = 0; i < 3; i++) {
-    jianpu->hasln[i] = 0;
-    ln[i][0] = 0;
-  }
+  rows_init(&jianpu->rows, 3);
+  for (i = 0; i < 3; i++) jianpu->hasln[i] = 0;
 }
 
 static void jianpu_sym(void *ctx, int c) {
@@ -673,90 +1564,189 @@ static void jianpu_sym(void *ctx, int c) {
   switch (c) {
     case '\n':
       for (i = 0; i < 3; i++) {
-        if (jianpu->hasln[i]) printf("%s%s\n", INDENT, ln[i]);
+        if (jianpu->hasln[i]) outrow(row(&jianpu->rows, i));
       }
       jianpu_reset(ctx);
       break;
-    case ' ':
-      for (i = 0; i < 3; i++) strcatf(ln[i], " ");
-      break;
+    case ' ': rows_catf(&jianpu->rows, " "); break;
     case '|':
-      strcatf(ln[0], "  ");
-      strcatf(ln[1], "%s| %s", DIM, RST);
-      strcatf(ln[2], "  ");
+      row_cat(&jianpu->rows, 0, "  ", 2);
+      row_catf(&jianpu->rows, 1, "%s| %s", DIM, RST);
+      row_cat(&jianpu->rows, 2, "  ", 2);
       break;
   }
 }
 
+/* Octave marks are escaped in markup */
+static const char *jianpu_mark(char c, char *buf) {
+  if (format != ANSI && (c == '<' || c == '>')) return c == '<' ? "&lt;" : "&gt;";
+  buf[0] = c;
+  buf[1] = 0;
+  return buf;
+}
+
 static void jianpu_note(void *ctx, int c) {
   struct jianpu *jianpu = (struct jianpu *)ctx;
   int n = c % 12;
   int o = c / 12;
   char *hoct = "      .:>>>>";
   char *loct = "<<<<*       ";
+  char mark[2];
   char *acc = " # #  # # # ";
   char *note = "112234455667";
   int isacc = acc[n] == '#';
   jianpu->hasln[1] = 1;
   if (hoct[o] != ' ') jianpu->hasln[0] = 1;
   if (loct[o] != ' ') jianpu->hasln[2] = 1;
-  strcatf(ln[0], "%s%s%c%s ", ACC, isacc ? " " : "", hoct[o], RST);
-  strcatf(ln[1], "%s%s%c%s ", ACC, isacc ? SHARP : "", note[n], RST);
-  strcatf(ln[2], "%s%s%c%s ", ACC, isacc ? " " : "", loct[o], RST);
+  row_catf(&jianpu->rows, 0, "%s%s%s%s ", ACC, isacc ? " " : "", jianpu_mark(hoct[o], mark), RST);
+  row_catf(&jianpu->rows, 1, "%s%s%c%s ", ACC, isacc ? SHARP : "", note[n], RST);
+  row_catf(&jianpu->rows, 2, "%s%s%s%s ", ACC, isacc ? " " : "", jianpu_mark(loct[o], mark), RST);
+}
+
+static int jianpu_cost(void *ctx, int c) {
+  (void)ctx;
+  (void)c;
+  return 0;
 }
 
 struct jianpu jnpu = {0};
-struct instr jianpu = {jianpu_reset, jianpu_sym, jianpu_note, &jnpu};
+struct instr jianpu = {jianpu_reset, jianpu_sym, jianpu_note, jianpu_cost, NULL, &jnpu};
+
+/* ------------- Pre-rendered rows for vertical note layouts ---------------- */
+
+/* Klavarscribo and Kalimba print a full row of keys per note. The row only
+ * depends on the instrument and the output style, so it is rendered once and
+ * every note just patches its own key cells at known byte offsets. */
+#define NKEYS 64 /* Max number of keys in a vertical layout */
+struct keypatch {
+  int key;
+  int lit; /* Key is played, not just a hint */
+  const char *color;
+  const char *fill;
+};
+
+struct keyrow {
+  int ready;
+  char blank[ROWSZ];  /* Keys without highlighted notes, used for spaces, too */
+  char bar[ROWSZ];    /* Keys crossed by a bar line */
+  int off[NKEYS + 1]; /* Byte offset of each key cell in the blank row */
+  int inchord;        /* Chord notes are collected and printed as a single row */
+  int nchord;
+  struct keypatch chord[NKEYS];
+};
+
+static void keyrow_add(struct keyrow *r, int i, char *color, char *fill, char *barfill) {
+  r->off[i] = strlen(r->blank);
+  strcatf(r->blank, "%s%s%s", color, fill, RST);
+  strcatf(r->bar, "%s%s%s", color, barfill, RST);
+  r->off[i + 1] = strlen(r->blank);
+}
+
+/* Print a blank row with some key cells replaced, patches are sorted by key */
+static void keyrow_print(struct keyrow *r, struct keypatch *p, int n) {
+  int i, pos = 0;
+  outs(INDENT);
+  for (i = 0; i < n; i++) {
+    out(r->blank + pos, r->off[p[i].key] - pos);
+    outs(p[i].color);
+    outs(p[i].fill);
+    outs(RST);
+    pos = r->off[p[i].key + 1];
+  }
+  outs(r->blank + pos);
+  out("\n", 1);
+}
+
+/* Print a note, or add it to the current chord keeping the patches sorted */
+static void keyrow_note(struct keyrow *r, struct keypatch *p, int n) {
+  int i, j;
+  if (!r->inchord) {
+    keyrow_print(r, p, n);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    for (j = r->nchord; j > 0 && r->chord[j - 1].key > p[i].key; j--);
+    if (j > 0 && r->chord[j - 1].key == p[i].key) {
+      if (p[i].lit) r->chord[j - 1] = p[i];
+      continue;
+    }
+    memmove(&r->chord[j + 1], &r->chord[j], (r->nchord - j) * sizeof(p[0]));
+    r->chord[j] = p[i];
+    r->nchord++;
+  }
+}
+
+static void keyrow_sym(struct keyrow *r, int c) {
+  switch (c) {
+    case '\n': break;
+    case '[':
+      r->inchord = 1;
+      r->nchord = 0;
+      break;
+    case ']':
+      if (r->inchord && r->nchord) keyrow_print(r, r->chord, r->nchord);
+      r->inchord = 0;
+      break;
+    case '|': outrow(r->bar); break;
+    default:  outrow(r->blank); break;
+  }
+}
 
 /* ----------------------- Klavarscribo -------------------------- */
 
 struct klavar {
   int n;
   int root;
+  struct keyrow row;
 };
 static int isacc[] = {0, 1, 0, 1, 0, 0, 1, 0, 1, 0, 1, 0};
-static void klavar_reset(void *ctx) { (void)ctx; }
-static void klavar_sym(void *ctx, int c) {
-  struct klavar *klavar = (struct klavar *)ctx;
+static void klavar_reset(void *ctx) {
   int i;
-  char *fill = " ";
-  if (c == ' ') fill = " ";
-  if (c == '|') fill = HLINE;
-  if (c == '\n') return;
-
-  printf("%s", INDENT);
+  struct klavar *klavar = (struct klavar *)ctx;
+  if (klavar->row.ready) return;
   for (i = 0; i < klavar->n; i++) {
-    printf("%s%s%s", (i % 12 == 0 ? ACC : DIM),
-           (isacc[i % 12] ? VLINE
-            : i % 12 == 0 ? DLINE
-                          : fill),
-           RST);
+    char *color = i % 12 == 0 ? ACC : DIM;
+    char *fill = isacc[i % 12] ? VLINE : i % 12 == 0 ? DLINE : " ";
+    keyrow_add(&klavar->row, i, color, fill, isacc[i % 12] || i % 12 == 0 ? fill : HLINE);
   }
-  printf("\n");
+  klavar->row.ready = 1;
 }
+static void klavar_sym(void *ctx, int c) { keyrow_sym(&((struct klavar *)ctx)->row, c); }
 
 static void klavar_note(void *ctx, int c) {
+  struct klavar *klavar = (struct klavar *)ctx;
+  struct keypatch p;
+  p.key = c - klavar->root;
+  if (p.key < 0 || p.key >= klavar->n) {
+    keyrow_note(&klavar->row, &p, 0);
+    return;
+  }
+  p.lit = 1;
+  p.color = ACC;
+  p.fill = isacc[p.key % 12] ? FE : FF;
+  keyrow_note(&klavar->row, &p, 1);
+}
+
+static int klavar_cost(void *ctx, int c) {
+  struct klavar *klavar = (struct klavar *)ctx;
+  return c >= klavar->root && c < klavar->root + klavar->n ? 0 : -1;
+}
+
+/* Chords are played in the root position with the root in the 4th octave */
+static void klavar_chord(void *ctx, int root, int quality) {
   int i;
   struct klavar *klavar = (struct klavar *)ctx;
-  printf("%s", INDENT);
-  for (i = 0; i < klavar->n; i++) {
-    char *fill = " ";
-    char *color = i % 12 == 0 ? ACC : DIM;
-    if (c == i + klavar->root) {
-      fill = isacc[i % 12] ? FE : FF;
-      color = ACC;
-    } else {
-      fill = isacc[i % 12] ? VLINE : i % 12 == 0 ? DLINE : " ";
-    }
-    printf("%s%s%s", color, fill, RST);
+  keyrow_sym(&klavar->row, '[');
+  for (i = 0; i < CHORDS[quality].n; i++) {
+    klavar_note(ctx, C4 + root + CHORDS[quality].tones[i]);
   }
-  printf("\n");
+  keyrow_sym(&klavar->row, ']');
 }
 
 struct klavar pianofull = {48, C4 - 12};
 struct klavar pianotoy = {25, C4};
-struct instr piano = {klavar_reset, klavar_sym, klavar_note, &pianofull};
-struct instr toy = {klavar_reset, klavar_sym, klavar_note, &pianotoy};
+struct instr piano = {klavar_reset, klavar_sym, klavar_note, klavar_cost, klavar_chord, &pianofull};
+struct instr toy = {klavar_reset, klavar_sym, klavar_note, klavar_cost, klavar_chord, &pianotoy};
 
 /* ---------------- Kalimba -------------------- */
 struct kalimba {
@@ -764,38 +1754,46 @@ struct kalimba {
   int left;
   int intervals[32];
   int marks[32];
+  int tine[128]; /* Note number to tine index + 1, zero if there is no such tine */
+  struct keyrow row;
 };
-static void kalimba_reset(void *ctx) { (void)ctx; }
-static void kalimba_sym(void *ctx, int c) {
-  int i;
+static void kalimba_reset(void *ctx) {
+  int i, tin;
   struct kalimba *kalimba = (struct kalimba *)ctx;
-  char *fill = DLINE;
-  if (c == '\n') return;
-  if (c == '|') fill = HLINE;
-  printf("%s", INDENT);
-  for (i = 0; i < kalimba->n; i++) { printf("%s%s%s", DIM, kalimba->marks[i] ? VLINE : fill, RST); }
-  printf("\n");
+  if (kalimba->row.ready) return;
+  for (i = 0, tin = kalimba->left; i < kalimba->n; tin += kalimba->intervals[i++]) {
+    keyrow_add(&kalimba->row, i, DIM, kalimba->marks[i] ? VLINE : DLINE,
+               kalimba->marks[i] ? VLINE : HLINE);
+    if (tin >= 0 && tin < 128) kalimba->tine[tin] = i + 1;
+  }
+  kalimba->row.ready = 1;
 }
+static void kalimba_sym(void *ctx, int c) { keyrow_sym(&((struct kalimba *)ctx)->row, c); }
 
 static void kalimba_note(void *ctx, int c) {
-  int i;
+  int i, j, n = 0;
   struct kalimba *kalimba = (struct kalimba *)ctx;
-  int tin = kalimba->left;
-  printf("%s", INDENT);
-  for (i = 0; i < kalimba->n; i++) {
-    char *fill = kalimba->marks[i] ? VLINE : DLINE;
-    char *color = DIM;
-    if (c == tin) {
-      fill = FF;
-      color = ACC;
-    } else if (isacc[c % 12] && (c == tin - 1 || c == tin + 1)) {
-      fill = FE;
-      color = DIM;
+  struct keypatch p[3], tmp;
+  for (i = -1; i <= 1; i++) {
+    if (c + i < 0 || c + i >= 128 || !kalimba->tine[c + i]) continue;
+    if (i != 0 && !isacc[c % 12]) continue;
+    p[n].key = kalimba->tine[c + i] - 1;
+    p[n].lit = i == 0;
+    p[n].color = i == 0 ? ACC : DIM;
+    p[n].fill = i == 0 ? FF : FE;
+    for (j = n++; j > 0 && p[j - 1].key > p[j].key; j--) {
+      tmp = p[j];
+      p[j] = p[j - 1];
+      p[j - 1] = tmp;
     }
-    printf("%s%s%s", color, fill, RST);
-    tin = tin + kalimba->intervals[i];
   }
-  printf("\n");
+  keyrow_note(&kalimba->row, p, n);
+}
+
+static int kalimba_cost(void *ctx, int c) {
+  struct kalimba *kalimba = (struct kalimba *)ctx;
+  kalimba_reset(kalimba); /* Builds the tine map once */
+  return c >= 0 && c < 128 && kalimba->tine[c] ? 0 : -1;
 }
 
 struct kalimba klmb17 = {
@@ -812,11 +1810,191 @@ struct kalimba klmb21 = {
     {-3, -4, -3, -4, -3, -4, -3, -3, -4, -2, 4, 3, 4, 3, 4, 3, 3, 4, 3, 4, 0},
     {0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0},
 };
-struct instr kalimba17 = {kalimba_reset, kalimba_sym, kalimba_note, &klmb17};
-struct instr kalimba21 = {kalimba_reset, kalimba_sym, kalimba_note, &klmb21};
+struct instr kalimba17 = {kalimba_reset, kalimba_sym, kalimba_note, kalimba_cost, NULL, &klmb17};
+struct instr kalimba21 = {kalimba_reset, kalimba_sym, kalimba_note, kalimba_cost, NULL, &klmb21};
 
 /* ---------------- TODO: Piano tabs like guiar -------------------- */
 
+/* ------------------------ WAV synthesis ---------------------------- */
+
+/* The wav instrument forwards everything to the instrument that renders the
+ * tab and synthesizes every note (or chord) and rest into a mono WAV file, a
+ * note of the unit length lasts one beat.
+ * Samples are produced in fixed-size blocks by simple branch-free loops. */
+#define WAVRATE 22050 /* Sample rate */
+#define WAVBLOCK 256  /* Samples per synthesis block */
+#define WAVPOLY 16    /* Max number of notes sounding together */
+#define WAVKS 2048    /* Max Karplus-Strong delay line, enough for ~11Hz */
+
+enum { PLUCK, SINE, SQUARE };
+
+struct osc {
+  double phase; /* 0..1 */
+  double step;  /* Phase increment per sample */
+  int len, pos; /* Plucked string delay line */
+  float ks[WAVKS];
+};
+
+struct wav {
+  struct instr *instr; /* Instrument that renders the tab */
+  FILE *f;
+  int timbre;
+  int bpm;
+  int chord;
+  int n; /* Number of notes in the current beat */
+  int notes[WAVPOLY];
+  long len; /* Number of samples written */
+  struct osc osc[WAVPOLY];
+};
+
+static void osc_init(struct osc *o, int timbre, int note) {
+  int i;
+  double freq = 440;
+  for (i = note; i > 69; i--) freq = freq * 1.0594630943592953;
+  for (i = note; i < 69; i++) freq = freq / 1.0594630943592953;
+  o->phase = 0;
+  o->step = freq / WAVRATE;
+  o->pos = 0;
+  o->len = (int)(WAVRATE / freq);
+  if (o->len < 2) o->len = 2;
+  if (o->len > WAVKS) o->len = WAVKS;
+  /* A plucked string starts with a burst of noise, deterministic for repeatable output */
+  for (i = 0; timbre == PLUCK && i < o->len; i++) {
+    o->ks[i] = (float)((rand() % 2001) - 1000) / 1000;
+  }
+}
+
+/* Add a block of samples of a single oscillator to the mix */
+static void osc_block(struct osc *o, int timbre, float *mix, int n) {
+  int i;
+  switch (timbre) {
+    case SINE:
+      for (i = 0; i < n; i++) {
+        double p = o->phase + i * o->step;
+        float x = (float)(2 * (p - (long)p) - 1);
+        mix[i] += 4 * x * (1 - (x < 0 ? -x : x)); /* Parabolic sine */
+      }
+      break;
+    case SQUARE:
+      for (i = 0; i < n; i++) {
+        double p = o->phase + i * o->step;
+        mix[i] += (p - (long)p) < 0.5 ? 0.5f : -0.5f;
+      }
+      break;
+    case PLUCK:
+      for (i = 0; i < n; i++) {
+        int next = o->pos + 1 == o->len ? 0 : o->pos + 1;
+        o->ks[o->pos] = (o->ks[o->pos] + o->ks[next]) * 0.498f;
+        mix[i] += o->ks[o->pos];
+        o->pos = next;
+      }
+      break;
+  }
+  o->phase = o->phase + n * o->step;
+  o->phase = o->phase - (long)o->phase;
+}
+
+static void wav_le(FILE *f, unsigned long v, int bytes) {
+  for (; bytes > 0; bytes--, v = v >> 8) fputc((int)(v & 0xff), f);
+}
+
+static void wav_header(struct wav *w) {
+  unsigned long size = w->len * 2;
+  fwrite("RIFF", 1, 4, w->f);
+  wav_le(w->f, 36 + size, 4);
+  fwrite("WAVEfmt ", 1, 8, w->f);
+  wav_le(w->f, 16, 4);          /* Format chunk size */
+  wav_le(w->f, 1, 2);           /* PCM */
+  wav_le(w->f, 1, 2);           /* Mono */
+  wav_le(w->f, WAVRATE, 4);     /* Sample rate */
+  wav_le(w->f, WAVRATE * 2, 4); /* Byte rate */
+  wav_le(w->f, 2, 2);           /* Block align */
+  wav_le(w->f, 16, 2);          /* Bits per sample */
+  fwrite("data", 1, 4, w->f);
+  wav_le(w->f, size, 4);
+}
+
+/* Synthesize all collected notes for a number of ticks, silence if none */
+static void wav_beat(struct wav *w, int ticks) {
+  float mix[WAVBLOCK];
+  unsigned char pcm[WAVBLOCK * 2];
+  long i, done, total = WAVRATE * 60L * ticks / ((long)w->bpm * TICKS);
+  long fade = WAVRATE / 100; /* 10ms fade in and fade out to avoid clicks */
+  float gain = 0.6f / (w->n < 2 ? 1 : w->n);
+  int j;
+  for (j = 0; j < w->n; j++) osc_init(&w->osc[j], w->timbre, w->notes[j]);
+  for (done = 0; done < total; done += WAVBLOCK) {
+    int n = total - done < WAVBLOCK ? (int)(total - done) : WAVBLOCK;
+    memset(mix, 0, sizeof(mix));
+    for (j = 0; j < w->n; j++) osc_block(&w->osc[j], w->timbre, mix, n);
+    for (i = 0; i < n; i++) {
+      long t = done + i, env = t < total - t ? t : total - t;
+      float v = mix[i] * gain * (env < fade ? (float)env / fade : 1);
+      if (v > 1) v = 1;
+      if (v < -1) v = -1;
+      pcm[i * 2] = (unsigned char)((long)(v * 32767) & 0xff);
+      pcm[i * 2 + 1] = (unsigned char)(((long)(v * 32767) >> 8) & 0xff);
+    }
+    fwrite(pcm, 2, n, w->f);
+  }
+  w->len += total;
+  w->n = 0;
+}
+
+static void wav_reset(void *ctx) {
+  struct wav *w = (struct wav *)ctx;
+  w->instr->reset(w->instr->ctx);
+}
+
+static void wav_sym(void *ctx, int c) {
+  struct wav *w = (struct wav *)ctx;
+  w->instr->sym(w->instr->ctx, c);
+  if ((c == '[' || c == '\n') && note_rest) wav_beat(w, note_rest);
+  if (c == '[') w->chord = 1;
+  if (c == ']') {
+    w->chord = 0;
+    if (w->n) wav_beat(w, note_len);
+  }
+}
+
+static void wav_note(void *ctx, int c) {
+  struct wav *w = (struct wav *)ctx;
+  w->instr->note(w->instr->ctx, c);
+  if (!w->chord && note_rest) wav_beat(w, note_rest);
+  if (w->n < WAVPOLY) w->notes[w->n++] = c;
+  if (!w->chord) wav_beat(w, note_len);
+}
+
+static int wav_cost(void *ctx, int c) {
+  struct wav *w = (struct wav *)ctx;
+  return w->instr->cost(w->instr->ctx, c);
+}
+
+/* Chord symbols are rendered, but not played */
+static void wav_chord(void *ctx, int root, int quality) {
+  struct wav *w = (struct wav *)ctx;
+  if (w->instr->chord) w->instr->chord(w->instr->ctx, root, quality);
+}
+
+static int wav_open(struct wav *w, const char *path, struct instr *instr) {
+  if ((w->f = fopen(path, "wb")) == NULL) return -1;
+  w->instr = instr;
+  w->timbre = SINE;
+  if (instr->note == frets_note || instr->note == klavar_note || instr->note == kalimba_note) {
+    w->timbre = PLUCK;
+  } else if (instr->note == harp_note) {
+    w->timbre = SQUARE;
+  }
+  wav_header(w);
+  return 0;
+}
+
+static void wav_close(struct wav *w) {
+  fseek(w->f, 0, SEEK_SET);
+  wav_header(w); /* Now with the actual data size */
+  fclose(w->f);
+}
+
 static int note(char c) {
   const int N[] = {9, 11, 0, 2, 4, 5, 7};
   if ((c >= 'A' && c <= 'G') || (c >= 'a' && c <= 'g')) {
@@ -825,194 +2003,2302 @@ static int note(char c) {
   return 0;
 }
 
-static void tabs_abc(FILE *f, struct instr *instr, int transpose) {
-  char line[LINESZ];
-  while (fgets(line, sizeof(line), f)) {
-    char *p;
-    int acc = 0;
-    int isabc = 1, q = 0;
-    /* Tell text/meta/lyrics from music notation lines */
-    for (p = line; *p; p++) {
-      if (*p == '"') {
-        q = !q;
-      } else if (!q && !isspace(*p) && !ispunct(*p) && !note(*p) && !isdigit(*p) && *p != 'z') {
-        isabc = 0;
-        break;
-      }
-    }
-    if (!isabc) {
-      printf("%s%s%s%s", INDENT, TXT, line, RST);
-      continue;
-    }
-    if (isempty(line)) {
-      printf("\n");
+/* Inline fields, like [K:G] or [V:1], returns the end of the field or NULL */
+static const char *inline_field(const char *p) {
+  if (p[0] != '[' || !isalpha(p[1]) || p[2] != ':') return NULL;
+  return strchr(p, ']');
+}
+
+/* Scale a length by a broken rhythm: halved b times for b > 0, dotted -b
+ * times for b < 0 */
+static int abc_scale(int len, int b) {
+  if (b > 4 || b < -4) b = b > 0 ? 4 : -4;
+  return b > 0 ? len >> b : b < 0 ? len * ((2 << -b) - 1) >> -b : len;
+}
+
+/* Parse the length after a note, like "2", "/" or "3/2", and a broken rhythm
+ * like ">" or "<<". The broken rhythm of the previous note is taken from
+ * *broken, the one for the next note is stored there. Returns ticks. */
+static int abc_length(char **s, int *broken) {
+  int num = 1, den = 1, len, k;
+  long d;
+  char *p = *s;
+  if (isdigit(*p)) num = (int)strtol(p, &p, 10);
+  while (*p == '/') {
+    p++;
+    d = isdigit(*p) ? strtol(p, &p, 10) : 2;
+    if (d > 0 && den * d <= TICKS) den = den * d;
+  }
+  len = abc_scale(TICKS * (num < 1000 ? num : 1000) / den, *broken);
+  for (k = 0; p[k] == '>'; k++);
+  if (k) {
+    len = abc_scale(len, -k);
+  } else {
+    for (k = 0; p[k] == '<'; k++);
+    len = abc_scale(len, k);
+    k = -k;
+  }
+  *broken = k;
+  *s = p + abs(k);
+  return len > 0 ? len : 1;
+}
+
+/* Tell text/meta/lyrics from music notation lines. Inline fields are skipped,
+ * but a line of nothing else is not music. */
+static int isabc(const char *line) {
+  const char *p, *e;
+  int q = 0, music = 0;
+  for (p = line; *p; p++) {
+    if (*p == '"') {
+      q = !q;
+    } else if (!q && (e = inline_field(p)) != NULL) {
+      p = e;
       continue;
+    } else if (!q && !isspace(*p) && !ispunct(*p) && !note(*p) && !isdigit(*p) && *p != 'z') {
+      return 0;
     }
+    if (!isspace(*p)) music = 1;
+  }
+  return music || inline_field(line + strspn(line, " \t")) == NULL;
+}
 
-    /* Render a note */
-    q = 0;
-
-    instr->reset(instr->ctx);
-    for (p = line; *p; p++) {
-      int n;
-      char c = *p;
-      if (c == '"') {
-        q = !q; /* TODO: maybe support chords output, too? Mind transposing! */
-      } else if (c == '\n')
-        instr->sym(instr->ctx, '\n');
-      else if (isspace(c))
-        instr->sym(instr->ctx, ' ');
-      else if (c == '|')
-        instr->sym(instr->ctx, '|');
-      else if (c == '_')
-        acc--;
-      else if (c == '^')
-        acc++;
-      n = note(c);
-      if (!q && n) {
-        while (*p) {
-          int nc = *++p;
-          switch (nc) {
-            case '#':  acc = acc + 1; break;
-            case '\'': acc = acc + 12; break;
-            case ',':  acc = acc - 12; break;
-            default:   p--; goto out;
-          }
+/* Feed a line of music notation into the instrument renderer */
+static void abc_line(char *line, struct instr *instr, int transpose) {
+  char *p, *e, *qs = NULL;
+  int acc = 0;
+  int q = 0;
+  int chord = 0, chord_len = 0;
+  int broken = 0, nobroken, rest = 0;
+  int root, quality;
+  instr->reset(instr->ctx);
+  for (p = line; *p; p++) {
+    int n;
+    char c = *p;
+    if (c == '"') {
+      q = !q;
+      if (q) {
+        qs = p + 1;
+      } else if (instr->chord && (quality = chord_parse(qs, p - qs, &root)) >= 0) {
+        instr->chord(instr->ctx, ((root + transpose) % 12 + 12) % 12, quality);
+      }
+    } else if (!q && inline_field(p)) {
+      p = (char *)inline_field(p);
+      continue;
+    } else if (!q && c == '[' && p[1] && (note(p[1]) || strchr("^_=", p[1]))) {
+      note_rest = rest;
+      rest = 0;
+      instr->sym(instr->ctx, '[');
+      note_rest = 0;
+      chord = 1;
+      chord_len = 0;
+    } else if (!q && c == ']' && chord) {
+      /* A chord lasts as long as its first note unless it has its own length */
+      e = p + 1;
+      note_len = abc_length(&e, &broken);
+      if (e == p + 1) note_len = chord_len ? chord_len : TICKS;
+      p = e - 1;
+      instr->sym(instr->ctx, ']');
+      chord = 0;
+    } else if (!q && c == 'z') {
+      e = p + 1;
+      rest += abc_length(&e, &broken);
+      p = e - 1;
+    } else if (c == '\n') {
+      if (chord) instr->sym(instr->ctx, ']');
+      chord = 0;
+      note_rest = rest;
+      rest = 0;
+      instr->sym(instr->ctx, '\n');
+      note_rest = 0;
+    } else if (isspace(c))
+      instr->sym(instr->ctx, ' ');
+    else if (c == '|')
+      instr->sym(instr->ctx, '|');
+    else if (c == '_')
+      acc--;
+    else if (c == '^')
+      acc++;
+    n = note(c);
+    if (!q && n) {
+      while (*p) {
+        int nc = *++p;
+        switch (nc) {
+          case '#':  acc = acc + 1; break;
+          case '\'': acc = acc + 12; break;
+          case ',':  acc = acc - 12; break;
+          default:   p--; goto out;
         }
-      out:
-        instr->note(instr->ctx, n + transpose + acc);
-        acc = 0;
       }
+    out:
+      e = p + 1;
+      nobroken = 0;
+      note_len = abc_length(&e, chord ? &nobroken : &broken);
+      p = e - 1;
+      if (chord && !chord_len) chord_len = note_len;
+      if (!chord) {
+        note_rest = rest;
+        rest = 0;
+      }
+      instr->note(instr->ctx, n + transpose + acc);
+      note_rest = 0;
+      acc = 0;
     }
   }
-  /* Final row may be without a newline, flush it */
-  instr->sym(instr->ctx, '\n');
+  note_len = TICKS;
 }
 
-static struct {
-  const char *name;
-  const char *descr;
-  struct instr *instr;
-} INST[] = {
-    /* String */
-    {"guitar", "6-string Guitar Tabs", &guitar},
-    {"uke", "Ukulele Tabs", &uke},
-    {"mandolin", "Mandolin Tabs", &mandolin},
-    {"cbg", "Cigar Box Guitar (GDg tuning)", &cbg},
-    {"diddley", "Diddley Bow (Unitar)", &diddley},
-    {"2gd", "Two-string Diddley Bow (G+D)", &gd},
-    {"2gc", "Two-string Diddley Bow (G+C)", &gc},
-    {"violin", "Violin Tabs", &violin},
-    /* Woodwind+Brass */
-    {"recorder", "Recorder (German System)", &german},
-    {"german", "Recorder (German System)", &german},
-    {"baroque", "Recorder (Baroque/English System)", &baroque},
-    {"english", "Recorder (Baroque/English System)", &baroque},
-    {"whistle", "Irish Tin Whistle in D", &tinwhistle},
-    {"xaphoon", "Xaphoon (Pocket Sax)", &xaphoon},
-    {"pendant", "Pendant Ocarina (4-hole)", &pendant},
-    {"naf", "Native American Flute in A (6-hole)", &naf},
-    {"naf6", "Native American Flute in A (6-hole)", &naf},
-    {"naf5", "Native American Flute in A (5-hole)", &naf5},
-    {"naf4", "Native American Flute in A (minor pentatonic, 4-hole)", &naf4},
-    {"trumpet", "Trumbet", &trumpet},
-    {"sax", "Alto Saxophone (Eb)", &sax},
-    /* Harmonicas */
-    {"harp", "Diatonic Harmonica", &diatonic},
-    {"diatonic", "Diatonic Harmonica", &diatonic},
-    {"chromatic", "Chromatic Harmonica", &chromatic},
-    /* Keys */
-    {"piano", "Klavarscribo for 48-key piano", &piano},
-    {"toy", "Toy 25-key piano", &toy},
-    {"kalimba", "Kalimba (17 keys)", &kalimba17},
-    {"kalimba21", "Kalimba (21 keys)", &kalimba21},
-    /* Other */
-    {"jianpu", "Chinese Numeric Notation", &jianpu},
-    {"123", "Chinese Numeric Notation", &jianpu},
+/* ------------------------- Octave folding ------------------------------ */
+
+/* Narrow instruments, like ocarinas, can't play many songs under any single
+ * transposition. With folding, every note of a line may be moved by octaves:
+ * a dynamic program picks an octave per note that keeps it playable and
+ * minimizes the leaps between consecutive notes, so a phrase going out of
+ * range moves as a whole rather than a single note jumping away. There are a
+ * few candidate octaves per note, so the program is linear in the line length
+ * and lines are folded one by one as they stream by. */
+#define NFOLDS 5       /* Candidate octave shifts, -2..+2 */
+#define FOLD_PENALTY 3 /* Cost of moving a note by an octave, in semitones of leaps */
+
+struct fold {
+  struct instr *instr; /* Instrument the notes are folded for */
+  int n, i;            /* Notes in the line, next note to play */
+  int note[LINESZ];
+  signed char shift[LINESZ]; /* Octaves to move every note by */
 };
 
-static void usage(const char *argv0) {
-  unsigned int i;
-  fprintf(stderr, "USAGE: %s [-i inst] [-t steps] [file ...]\n", argv0);
-  fprintf(stderr, "\nOptions:\n\n");
-  fprintf(stderr, "  -i NAME\tSpecify the instrument for rendering tabs (see below)\n");
-  fprintf(stderr, "  -t NUM\tTranspose the music by NUM semitones\n");
-  fprintf(stderr, "  -c    \tForce colored output\n");
-  fprintf(stderr, "  -C    \tDisable colored output\n");
-  fprintf(stderr, "  -a    \tDisable unicode (use ASCII)\n");
-  fprintf(stderr, "  -h    \tShow this help\n");
-  fprintf(stderr, "\nInstruments:\n\n");
-  for (i = 0; i < sizeof(INST) / sizeof(INST[0]); i++) {
-    fprintf(stderr, "  * %-10s\t%s\n", INST[i].name, INST[i].descr);
-  }
-  fprintf(stderr, "\n");
+static int folding;
+static struct fold fold;
+
+static void fold_reset(void *ctx) {
+  struct fold *f = (struct fold *)ctx;
+  f->instr->reset(f->instr->ctx);
+}
+static void fold_sym(void *ctx, int c) {
+  struct fold *f = (struct fold *)ctx;
+  f->instr->sym(f->instr->ctx, c);
+}
+static void fold_note(void *ctx, int n) {
+  struct fold *f = (struct fold *)ctx;
+  f->instr->note(f->instr->ctx, n + (f->i < f->n ? 12 * f->shift[f->i++] : 0));
+}
+static int fold_cost(void *ctx, int n) {
+  struct fold *f = (struct fold *)ctx;
+  return f->instr->cost(f->instr->ctx, n);
+}
+static void fold_chord(void *ctx, int root, int quality) {
+  struct fold *f = (struct fold *)ctx;
+  f->instr->chord(f->instr->ctx, root, quality);
 }
 
-int main(int argc, char *argv[]) {
-  int c;
-  int found = 0;
-  int colorize = 0;
-  int transpose = 0;
-  int padding = 2;
-  unsigned int t;
-  char *endp;
-  struct instr *instr = &guitar;
+/* The first pass over a line only collects its notes */
+static void fold_nop(void *ctx) { (void)ctx; }
+static void fold_nosym(void *ctx, int c) {
+  (void)ctx;
+  (void)c;
+}
+static void fold_collect(void *ctx, int n) {
+  struct fold *f = (struct fold *)ctx;
+  if (f->n < LINESZ) f->note[f->n++] = n;
+}
 
-  while ((c = getopt(argc, argv, "hCcai:p:t:")) != -1) {
-    switch (c) {
-      case 'c': colorize = 1; break;
-      case 'C': decolorize(); break;
-      case 'a': asciify(); break;
-      case 'i':
-        for (t = 0; t < sizeof(INST) / sizeof(INST[0]); t++) {
-          if (strcmp(INST[t].name, optarg) == 0) {
-            instr = INST[t].instr;
-            found = 1;
-            break;
-          }
-        }
-        if (!found) {
-          fprintf(stderr, "Unknown instrument: %s\n", optarg);
-          return 1;
-        }
-        break;
-      case 't':
-        transpose = strtol(optarg, &endp, 0);
-        if (endp == optarg || *endp != '\0') {
-          fprintf(stderr, "%s: -t requires a number, got %s\n", argv[0], optarg);
-          return 1;
-        }
-        if (transpose < -24 || transpose > 24) {
-          fprintf(stderr, "%s: invalid transpose, should be -24..+24\n", argv[0]);
-          return 1;
-        }
-        break;
-      case 'p':
-        padding = strtol(optarg, &endp, 0);
-        if (endp == optarg || *endp != '\0') {
-          fprintf(stderr, "%s: -I requires a number, got %s\n", argv[0], optarg);
-          return 1;
-        }
-        if (padding < 0 || padding > 99) {
-          fprintf(stderr, "%s: invalid padding, should be 0..99\n", argv[0]);
-          return 1;
+/* Pick the octave of every note with the least leaps in total */
+static void fold_solve(struct fold *f) {
+  static long cost[LINESZ][NFOLDS];
+  static signed char from[LINESZ][NFOLDS];
+  int i, j, k, any;
+  for (i = 0; i < f->n; i++) {
+    for (k = 0, any = 0; k < NFOLDS; k++) {
+      int p = f->note[i] + 12 * (k - NFOLDS / 2);
+      cost[i][k] = -1; /* Unplayable */
+      if (p < 0 || p > 127 || f->instr->cost(f->instr->ctx, p) < 0) continue;
+      cost[i][k] = FOLD_PENALTY * abs(k - NFOLDS / 2);
+      any = 1;
+    }
+    if (!any) cost[i][NFOLDS / 2] = 0; /* Nothing helps, leave the note as is */
+    for (k = 0; k < NFOLDS; k++) {
+      long best = -1;
+      if (cost[i][k] < 0 || i == 0) continue;
+      for (j = 0; j < NFOLDS; j++) {
+        long c = cost[i - 1][j] + abs(f->note[i] - f->note[i - 1] + 12 * (k - j));
+        if (cost[i - 1][j] >= 0 && (best < 0 || c < best)) {
+          best = c;
+          from[i][k] = j;
         }
-        break;
-      default: usage(argv[0]); return 1;
+      }
+      cost[i][k] += best;
+    }
+  }
+  for (i = f->n - 1, k = -1; i >= 0; i--) {
+    if (k < 0) {
+      for (j = 0; j < NFOLDS; j++) {
+        if (cost[i][j] >= 0 && (k < 0 || cost[i][j] < cost[i][k])) k = j;
+      }
     }
+    f->shift[i] = k - NFOLDS / 2;
+    k = from[i][k];
   }
+}
 
-  if ((!isatty(STDOUT_FILENO) || (getenv("NO_COLOR") != NULL && strcmp(getenv("NO_COLOR"), "0"))) &&
-      !colorize) {
-    decolorize();
+/* Render a line of music, with notes folded into the range of the instrument
+ * if enabled */
+static void fold_line(char *line, struct instr *instr, int transpose) {
+  static struct instr collect = {fold_nop, fold_nosym, fold_collect, fold_cost, NULL, &fold};
+  static struct instr play = {fold_reset, fold_sym, fold_note, fold_cost, NULL, &fold};
+  if (!folding) {
+    abc_line(line, instr, transpose);
+    return;
   }
+  fold.instr = instr;
+  fold.n = fold.i = 0;
+  abc_line(line, &collect, transpose);
+  fold_solve(&fold);
+  play.chord = instr->chord ? fold_chord : NULL;
+  abc_line(line, &play, transpose);
+}
 
-  memset(VINDENT, '\n', padding / 2); /* terminal fonts usually have 2:1 proportions */
+/* ------------------------- Rendered lines cache ------------------------ */
+
+/* Songs repeat their lines a lot, so rendered lines are kept in a bounded
+ * direct-mapped cache keyed by the line bytes, the instrument and the
+ * transposition, and repeated lines are emitted with a single copy. The style
+ * doesn't change once rendering starts. Only complete lines are cached, a
+ * line without a newline leaves rows pending in the renderer. */
+#define NMEMO 4096                /* Cache slots */
+#define MEMOSZ (16 * 1024 * 1024) /* Max bytes of cached output */
+
+struct memo {
+  unsigned long hash;
+  struct instr *instr;
+  int transpose;
+  unsigned gen; /* instr_gen of the rendering */
+  char *line;
+  char *out;
+  size_t outlen;
+};
+
+static struct memo memo[NMEMO];
+static size_t memo_size;
+static long memo_hits, memo_misses;
+static int memo_off; /* Renderers with side effects, like WAV synthesis, are not cached */
+
+static void memo_line(char *line, struct instr *instr, int transpose) {
+  static struct out tmp = {NULL, 0, 0, -1};
+  struct out *o = out_cur;
+  struct memo *m;
+  unsigned long hash = 2166136261UL;
+  size_t len = strlen(line);
+  char *p;
+  if (memo_off || len == 0 || line[len - 1] != '\n') {
+    fold_line(line, instr, transpose);
+    return;
+  }
+  for (p = line; *p; p++) hash = ((hash ^ (unsigned char)*p) * 16777619UL) & 0xffffffffUL;
+  hash = hash ^ ((unsigned long)transpose * 2654435761UL);
+  m = &memo[hash % NMEMO];
+  if (m->line && m->hash == hash && m->instr == instr && m->transpose == transpose &&
+      m->gen == instr_gen && strcmp(m->line, line) == 0) {
+    memo_hits++;
+    out(m->out, m->outlen);
+    return;
+  }
+  memo_misses++;
+  tmp.len = 0;
+  out_cur = &tmp;
+  fold_line(line, instr, transpose);
+  out_cur = o;
+  out(tmp.buf, tmp.len);
+  if (m->line) {
+    memo_size -= strlen(m->line) + m->outlen;
+    free(m->line);
+    free(m->out);
+    m->line = NULL;
+  }
+  if (memo_size + len + tmp.len > MEMOSZ) return;
+  m->hash = hash;
+  m->instr = instr;
+  m->transpose = transpose;
+  m->gen = instr_gen;
+  m->line = strcpy(xrealloc(NULL, len + 1), line);
+  m->out = memcpy(xrealloc(NULL, tmp.len + 1), tmp.buf, tmp.len);
+  m->outlen = tmp.len;
+  memo_size += len + tmp.len;
+}
+
+/* ------------------------ ASCII string tabs ---------------------------- */
+
+/* Existing tabs like "e|--0--2--|", including the ones rendered by frets, are
+ * read back as music: rows of a block are collected until a line that is not
+ * a tab row, then columns are scanned left to right and fret numbers become
+ * notes of the strings, numbers in the same column become chords. */
+struct asciitab {
+  int n, cap;          /* Rows in the current block */
+  char (*row)[LINESZ]; /* Row bodies, after the string labels */
+  int *len;            /* Row body lengths */
+  int *pc;             /* Pitch class of every string label */
+  int *roots;          /* Open string notes */
+  char *tuning;        /* Label letters, same as in struct frets */
+};
+
+/* Parse a tab row, returns the row body or NULL if the line is not a tab row */
+static char *tab_row(char *line, int *pc, char *label) {
+  const int N[] = {9, 11, 0, 2, 4, 5, 7};
+  char *p = line + strspn(line, " \t"), *body;
+  int dashes = 0;
+  if (toupper(*p) < 'A' || toupper(*p) > 'G') return NULL;
+  *label = *p;
+  *pc = N[toupper(*p) - 'A'];
+  if (*++p == '#' || (*p == 'b' && p[1] && strchr(" |:", p[1]))) {
+    *pc = (*pc + (*p == '#' ? 1 : 11)) % 12;
+    p++;
+  }
+  p = p + strspn(p, " ");
+  if (*p == '|' || *p == ':') {
+    body = p + 1;
+  } else if (strncmp(p, "│", 3) == 0) {
+    body = p + 3;
+  } else {
+    return NULL;
+  }
+  for (p = body; *p && *p != '\n' && *p != '\r'; p++) {
+    if (*p == '-') {
+      dashes++;
+    } else if (strncmp(p, "│", 3) == 0) {
+      p = p + 2;
+    } else if (!isdigit(*p) && !strchr("|hpbr/\\~x()<>.*^ LH", *p)) {
+      return NULL;
+    }
+  }
+  return dashes >= 4 ? body : NULL;
+}
+
+/* Open string notes: a known tuning, or every string above the lower one */
+static void asciitab_roots(struct asciitab *at) {
+  int i, j, k;
+  for (k = 0; k < 2; k++) {
+    for (i = 0; i < NFRETS; i++) {
+      struct frets *f = FRETS[i];
+      if (f->n != at->n) continue;
+      for (j = 0; j < at->n && (k ? toupper(f->tuning[j]) == toupper(at->tuning[j])
+                                   : f->tuning[j] == at->tuning[j]);
+           j++);
+      if (j == at->n) {
+        memcpy(at->roots, f->roots, at->n * sizeof(int));
+        return;
+      }
+    }
+  }
+  for (i = at->n - 1; i >= 0; i--) {
+    int lo = i == at->n - 1 ? C4 - 21 : at->roots[i + 1]; /* Lowest string from E2 up */
+    at->roots[i] = lo + 1 + ((at->pc[i] - lo - 1) % 12 + 12) % 12;
+  }
+}
+
+static void asciitab_flush(struct asciitab *at, struct instr *instr, int transpose) {
+  int i, c, len = 0, notes[64], n;
+  if (at->n == 0) return;
+  asciitab_roots(at);
+  instr->reset(instr->ctx);
+  for (i = 0; i < at->n; i++) {
+    if (at->len[i] > len) len = at->len[i];
+  }
+  for (c = 0; c < len; c++) {
+    int bar = 0;
+    for (i = at->n - 1, n = 0; i >= 0; i--) {
+      char *r = at->row[i];
+      if (at->len[i] <= c) continue;
+      if (r[c] == '|' || strncmp(r + c, "│", 3) == 0) bar = 1;
+      if (isdigit(r[c]) && (c == 0 || !isdigit(r[c - 1])) && n < 64) {
+        int fret = atoi(r + c);
+        if (fret <= 24) notes[n++] = at->roots[i] + fret + transpose;
+      }
+    }
+    if (n > 1) instr->sym(instr->ctx, '[');
+    for (i = 0; i < n; i++) instr->note(instr->ctx, notes[i]);
+    if (n > 1) instr->sym(instr->ctx, ']');
+    if (n > 0) instr->sym(instr->ctx, ' ');
+    if (bar) instr->sym(instr->ctx, '|');
+  }
+  instr->sym(instr->ctx, '\n');
+  at->n = 0;
+}
+
+/* A block ends at the first non-tab line, or when its top string repeats
+ * unless a known tuning has it twice, returns 1 if the line was a tab row */
+static int asciitab_line(struct asciitab *at, char *line, struct instr *instr, int transpose) {
+  char label, *body;
+  int i, pc;
+  if ((body = tab_row(line, &pc, &label)) == NULL) {
+    asciitab_flush(at, instr, transpose);
+    return 0;
+  }
+  if (at->n > 0 && toupper(label) == toupper(at->tuning[0])) {
+    for (i = 0; i < NFRETS; i++) {
+      struct frets *f = FRETS[i];
+      int j;
+      for (j = 0; j < at->n && j < f->n && toupper(f->tuning[j]) == toupper(at->tuning[j]); j++);
+      if (j == at->n && f->n > j && toupper(f->tuning[j]) == toupper(label)) break;
+    }
+    if (i == NFRETS) asciitab_flush(at, instr, transpose);
+  }
+  if (at->n == at->cap) {
+    at->cap = at->cap ? at->cap * 2 : 8;
+    at->row = xrealloc(at->row, at->cap * sizeof(at->row[0]));
+    at->len = xrealloc(at->len, at->cap * sizeof(int));
+    at->pc = xrealloc(at->pc, at->cap * sizeof(int));
+    at->roots = xrealloc(at->roots, at->cap * sizeof(int));
+    at->tuning = xrealloc(at->tuning, at->cap + 1);
+  }
+  strcpy(at->row[at->n], body);
+  at->len[at->n] = strcspn(body, "\r\n");
+  at->pc[at->n] = pc;
+  at->tuning[at->n++] = label;
+  at->tuning[at->n] = 0;
+  return 1;
+}
+
+/* ------------------ Multi-voice music (V: fields) --------------------- */
+
+/* Music lines of all voices in a system are buffered and merged into a single
+ * line: bar by bar, the voices are lined up by the lengths of their notes and
+ * the notes starting at the same time become a chord, lasting until the next
+ * note of any voice starts. Only one system per voice is buffered. */
+#define NVOICES 8
+struct voices {
+  int n;                      /* Number of voices seen so far, zero if none */
+  int cur;                    /* Current voice */
+  char id[NVOICES][16];       /* Voice names */
+  int has[NVOICES];           /* Voice has a pending line in the system */
+  char ln[NVOICES][LINESZ];   /* Pending music lines */
+  char text[LINESZ * 4];      /* Lyrics and other text lines following the system */
+  char merged[NVOICES * LINESZ * 4];
+};
+
+static int voice_id(struct voices *vs, const char *s) {
+  int i;
+  size_t n = strcspn(s, " \t\r\n]");
+  for (i = 0; i < vs->n; i++) {
+    if (strlen(vs->id[i]) == n && strncmp(vs->id[i], s, n) == 0) return i;
+  }
+  if (vs->n == NVOICES) return NVOICES - 1;
+  snprintf(vs->id[vs->n], sizeof(vs->id[0]), "%.*s", (int)n, s);
+  return vs->n++;
+}
+
+/* Append bytes to a bounded merge buffer */
+static void voice_cat(char *dst, size_t *len, size_t cap, const char *s, size_t n) {
+  if (*len + n >= cap) return;
+  memcpy(dst + *len, s, n);
+  *len += n;
+}
+
+/* Copy the next note, chord or rest of a voice, stops at bar lines. Chord
+ * symbols and annotations in quotes are copied separately. The length of the
+ * note is stored in len, zero at a bar line or at the end of the line. */
+static char *voice_slot(char *p, char *dst, size_t *n, char *ann, size_t *annlen, int *len,
+                        int *broken) {
+  char *start, *e;
+  int first = 0, nobroken = 0;
+  *len = 0;
+  for (;;) {
+    if (*p == '\0' || *p == '\n' || *p == '|' || *p == ':' || (*p == '[' && p[1] == '|')) {
+      return p;
+    } else if (*p == '"' && strchr(p + 1, '"')) {
+      start = p;
+      p = strchr(p + 1, '"') + 1;
+      voice_cat(ann, annlen, LINESZ, start, p - start);
+    } else if (inline_field(p)) {
+      p = (char *)inline_field(p) + 1; /* Key and meter changes are not rendered */
+    } else if (*p == '[' && p[1] && (note(p[1]) || strchr("^_=", p[1]))) {
+      for (p++; *p && *p != ']' && *p != '\n'; p++) {
+        if (note(*p) || strchr("^_=,'#", *p)) voice_cat(dst, n, LINESZ, p, 1);
+        if (note(*p) && !first) {
+          e = p + 1 + strspn(p + 1, ",'#");
+          first = abc_length(&e, &nobroken);
+        }
+      }
+      *len = first ? first : TICKS;
+      if (*p != ']') return p;
+      e = ++p;
+      first = abc_length(&e, broken);
+      if (e != p) *len = first;
+      return e;
+    } else if (note(*p) || strchr("^_=", *p)) {
+      start = p;
+      p = p + strspn(p, "^_=");
+      if (note(*p)) p = p + 1 + strspn(p + 1, ",'#");
+      voice_cat(dst, n, LINESZ, start, p - start);
+      *len = abc_length(&p, broken);
+      return p;
+    } else if (*p == 'z') {
+      p++;
+      *len = abc_length(&p, broken);
+      return p;
+    } else {
+      p++;
+    }
+  }
+}
+
+/* Append the notes sounding together for a number of ticks, as "[CEG]3/2 "
+ * or as a rest */
+static void voice_chord(char *dst, size_t *len, size_t cap, char *notes, size_t n, int ticks) {
+  char s[32];
+  int a = ticks, b = TICKS, r;
+  while (b) {
+    r = a % b;
+    a = b;
+    b = r;
+  }
+  if (n) {
+    voice_cat(dst, len, cap, "[", 1);
+    voice_cat(dst, len, cap, notes, n);
+  }
+  sprintf(s, "%s", n ? "]" : "z");
+  if (ticks / a != 1) sprintf(s + strlen(s), "%d", ticks / a);
+  if (TICKS / a != 1) sprintf(s + strlen(s), "/%d", TICKS / a);
+  if (n) strcat(s, " ");
+  voice_cat(dst, len, cap, s, strlen(s));
+}
+
+static void voices_flush(struct voices *vs, struct instr *instr, int transpose) {
+  char *p[NVOICES];
+  char *m = vs->merged;
+  char notes[LINESZ], ann[LINESZ], ev[NVOICES][LINESZ], *text, *e;
+  size_t evlen[NVOICES];
+  int t[NVOICES], dur[NVOICES], broken[NVOICES];
+  size_t len = 0, nlen = 0, alen, cap = sizeof(vs->merged) - 2;
+  int i, n = 0, now, start = -1;
+  for (i = 0; i < vs->n; i++) {
+    if (vs->has[i]) p[n++] = vs->ln[i];
+    vs->has[i] = 0;
+  }
+  if (n == 1) {
+    memo_line(p[0], instr, transpose); /* A single voice is rendered as usual */
+    n = 0;
+  }
+  for (i = 0; i < n; i++) t[i] = dur[i] = broken[i] = 0;
+  while (n) {
+    int bar = 0, done = 1;
+    /* A voice reads its next note once the previous one is merged */
+    alen = 0;
+    for (i = 0, now = -1; i < n; i++) {
+      if (!dur[i]) {
+        evlen[i] = 0;
+        p[i] = voice_slot(p[i], ev[i], &evlen[i], ann, &alen, &dur[i], &broken[i]);
+      }
+      if (dur[i] && (now < 0 || t[i] < now)) now = t[i];
+    }
+    if (now < 0) {
+      for (i = 0; i < n; i++) now = t[i] > now ? t[i] : now;
+    }
+    /* Notes sound together until the next note of any voice starts */
+    if (start >= 0 && now > start) voice_chord(m, &len, cap, notes, nlen, now - start);
+    voice_cat(m, &len, cap, ann, alen);
+    start = -1;
+    nlen = 0;
+    for (i = 0; i < n; i++) {
+      if (dur[i] && t[i] == now) {
+        voice_cat(notes, &nlen, LINESZ, ev[i], evlen[i]);
+        t[i] += dur[i];
+        dur[i] = 0;
+        start = now;
+      }
+    }
+    if (start >= 0) continue;
+    /* Every voice is at a bar line or at the end of its line */
+    for (i = 0; i < n; i++) {
+      char *q = p[i];
+      t[i] = 0;
+      p[i] = p[i] + strspn(p[i], "|:[]");
+      if (p[i] != q && !bar) {
+        voice_cat(m, &len, cap, q, p[i] - q);
+        voice_cat(m, &len, cap, " ", 1);
+        bar = 1;
+      }
+      if (*p[i] && *p[i] != '\n') done = 0;
+    }
+    if (done) {
+      strcpy(m + len, "\n");
+      memo_line(m, instr, transpose);
+      break;
+    }
+  }
+  for (text = vs->text; *text; text = e) {
+    e = text + strcspn(text, "\n");
+    e = e + (*e == '\n');
+    outs(INDENT);
+    outs(TXT);
+    outtext(text, e - text);
+    outs(RST);
+  }
+  vs->text[0] = 0;
+}
+
+/* Handle V: fields and music lines of multi-voice tunes, returns 0 if the line
+ * should be rendered as usual */
+static int voices_line(struct voices *vs, char *line, struct instr *instr, int transpose) {
+  int i;
+  if (strncmp(line, "V:", 2) == 0) {
+    vs->cur = voice_id(vs, line + 2 + strspn(line + 2, " "));
+    return 1;
+  }
+  if (strncmp(line, "[V:", 3) == 0 && strchr(line, ']')) {
+    vs->cur = voice_id(vs, line + 3 + strspn(line + 3, " "));
+    line = strchr(line, ']') + 1;
+  }
+  if (vs->n == 0) return 0;
+  if (isempty(line) || !isabc(line)) {
+    /* Text is printed after the pending system, blank lines end the system */
+    for (i = 0; i < vs->n && !vs->has[i]; i++);
+    if (i == vs->n || isempty(line) || strlen(vs->text) + LINESZ + 100 >= sizeof(vs->text)) {
+      voices_flush(vs, instr, transpose);
+      return 0;
+    }
+    strcat(vs->text, line);
+    return 1;
+  }
+  if (vs->has[vs->cur]) voices_flush(vs, instr, transpose);
+  strcpy(vs->ln[vs->cur], line);
+  vs->has[vs->cur] = 1;
+  return 1;
+}
+
+static void tabs_line(struct voices *vs, struct asciitab *at, char *line, struct instr *instr,
+                      int transpose) {
+  if (asciitab_line(at, line, instr, transpose)) {
+    /* Buffered as a part of a tab block */
+  } else if (voices_line(vs, line, instr, transpose)) {
+    /* Buffered as a part of a multi-voice system */
+  } else if (!isabc(line)) {
+    outs(INDENT);
+    outs(TXT);
+    outtext(line, strlen(line));
+    outs(RST);
+  } else if (isempty(line)) {
+    out("\n", 1);
+  } else {
+    memo_line(line, instr, transpose);
+  }
+}
+
+static void tabs_end(struct voices *vs, struct asciitab *at, struct instr *instr, int transpose) {
+  asciitab_flush(at, instr, transpose);
+  voices_flush(vs, instr, transpose);
+  /* Final row may be without a newline, flush it */
+  instr->sym(instr->ctx, '\n');
+}
+
+static void tabs_abc(FILE *f, struct instr *instr, int transpose) {
+  char line[LINESZ];
+  static struct voices vs;
+  static struct asciitab at;
+  vs.n = vs.cur = 0;
+  while (fgets(line, sizeof(line), f)) {
+    tabs_line(&vs, &at, line, instr, transpose);
+    if (out_cur->tty) out_flush();
+  }
+  tabs_end(&vs, &at, instr, transpose);
+}
+
+/* Render music from memory, like a tune of a mapped archive */
+static void tabs_mem(const char *p, size_t len, struct instr *instr, int transpose) {
+  char line[LINESZ];
+  const char *end = p + len;
+  static struct voices vs;
+  static struct asciitab at;
+  vs.n = vs.cur = 0;
+  while (p < end) {
+    size_t n = end - p;
+    const char *nl = memchr(p, '\n', n);
+    if (nl) n = nl - p + 1;
+    if (n > LINESZ - 1) n = LINESZ - 1; /* Long lines are split, like with fgets */
+    memcpy(line, p, n);
+    line[n] = 0;
+    p += n;
+    tabs_line(&vs, &at, line, instr, transpose);
+    if (out_cur->tty) out_flush();
+  }
+  tabs_end(&vs, &at, instr, transpose);
+}
+
+/* ------------------ Instrument recommendations --------------------- */
+
+#define NNOTES 128 /* MIDI note range */
+struct hist {
+  long n[NNOTES]; /* Number of occurrences of every note */
+  long total;
+};
+static void hist_reset(void *ctx) { (void)ctx; }
+static void hist_sym(void *ctx, int c) {
+  (void)ctx;
+  (void)c;
+}
+static void hist_note(void *ctx, int c) {
+  struct hist *h = (struct hist *)ctx;
+  if (c >= 0 && c < NNOTES) h->n[c]++;
+  h->total++;
+}
+
+/* Collect a pitch histogram of all music lines in a file */
+static void hist_abc(FILE *f, struct hist *h) {
+  char line[LINESZ];
+  struct instr instr = {hist_reset, hist_sym, hist_note, NULL, NULL, NULL};
+  static struct asciitab at;
+  instr.ctx = h;
+  while (fgets(line, sizeof(line), f)) {
+    if (!asciitab_line(&at, line, &instr, 0) && isabc(line)) abc_line(line, &instr, 0);
+  }
+  asciitab_flush(&at, &instr, 0);
+}
+
+static struct {
+  const char *name;
+  const char *descr;
+  struct instr *instr;
+} INST[] = {
+    /* String */
+    {"guitar", "6-string Guitar Tabs", &guitar},
+    {"uke", "Ukulele Tabs", &uke},
+    {"mandolin", "Mandolin Tabs", &mandolin},
+    {"cbg", "Cigar Box Guitar (GDg tuning)", &cbg},
+    {"diddley", "Diddley Bow (Unitar)", &diddley},
+    {"2gd", "Two-string Diddley Bow (G+D)", &gd},
+    {"2gc", "Two-string Diddley Bow (G+C)", &gc},
+    {"violin", "Violin Tabs", &violin},
+    {"kora", "Kora (21 strings in F)", &kora},
+    /* Woodwind+Brass */
+    {"recorder", "Recorder (German System)", &german},
+    {"german", "Recorder (German System)", &german},
+    {"baroque", "Recorder (Baroque/English System)", &baroque},
+    {"english", "Recorder (Baroque/English System)", &baroque},
+    {"whistle", "Irish Tin Whistle in D", &tinwhistle},
+    {"xaphoon", "Xaphoon (Pocket Sax)", &xaphoon},
+    {"pendant", "Pendant Ocarina (4-hole)", &pendant},
+    {"naf", "Native American Flute in A (6-hole)", &naf},
+    {"naf6", "Native American Flute in A (6-hole)", &naf},
+    {"naf5", "Native American Flute in A (5-hole)", &naf5},
+    {"naf4", "Native American Flute in A (minor pentatonic, 4-hole)", &naf4},
+    {"trumpet", "Trumbet", &trumpet},
+    {"sax", "Alto Saxophone (Eb)", &sax},
+    /* Harmonicas */
+    {"harp", "Diatonic Harmonica", &diatonic},
+    {"diatonic", "Diatonic Harmonica", &diatonic},
+    {"chromatic", "Chromatic Harmonica", &chromatic},
+    /* Keys */
+    {"piano", "Klavarscribo for 48-key piano", &piano},
+    {"toy", "Toy 25-key piano", &toy},
+    {"kalimba", "Kalimba (17 keys)", &kalimba17},
+    {"kalimba21", "Kalimba (21 keys)", &kalimba21},
+    /* Other */
+    {"jianpu", "Chinese Numeric Notation", &jianpu},
+    {"123", "Chinese Numeric Notation", &jianpu},
+};
+
+#define NINST (sizeof(INST) / sizeof(INST[0]))
+
+struct rank {
+  unsigned int inst; /* Index in INST */
+  int transpose;
+  long missing; /* Number of unplayable notes */
+  long cost;    /* Total difficulty of all playable notes */
+};
+
+static int rank_cmp(const void *a, const void *b) {
+  const struct rank *x = (const struct rank *)a, *y = (const struct rank *)b;
+  if (x->missing != y->missing) return x->missing < y->missing ? -1 : 1;
+  if (x->cost != y->cost) return x->cost < y->cost ? -1 : 1;
+  return abs(x->transpose) - abs(y->transpose);
+}
+
+/* Count unplayable notes and the total difficulty of the music */
+static void rank_eval(struct instr *instr, struct hist *h, int transpose, struct rank *r) {
+  int c, cost;
+  r->transpose = transpose;
+  r->missing = h->total;
+  r->cost = 0;
+  for (c = 0; c < NNOTES; c++) {
+    int t = c + transpose;
+    if (h->n[c] && t >= 0 && t < NNOTES && (cost = instr->cost(instr->ctx, t)) >= 0) {
+      r->missing -= h->n[c];
+      r->cost += h->n[c] * cost;
+    }
+  }
+}
+
+/* Find the best transposition for every instrument and print them ranked */
+static void recommend(struct hist *h) {
+  struct rank r[NINST], best, cur;
+  unsigned int i, j, n = 0;
+  int t;
+  if (h->total == 0) {
+    outf("%sNo notes found\n", INDENT);
+    return;
+  }
+  for (i = 0; i < NINST; i++) {
+    struct instr *instr = INST[i].instr;
+    for (j = 0; j < i && INST[j].instr != instr; j++);
+    if (j < i) continue; /* Skip aliases */
+    for (t = -24; t <= 24; t++) {
+      rank_eval(instr, h, t, &cur);
+      cur.inst = i;
+      if (t == -24 || rank_cmp(&cur, &best) < 0) best = cur;
+    }
+    r[n++] = best;
+  }
+  qsort(r, n, sizeof(r[0]), rank_cmp);
+  outf("%s%s%-3s %-10s %5s %8s %10s  %s%s\n", INDENT, DIM, "#", "NAME", "-t", "PLAYABLE",
+       "DIFFICULTY", "DESCRIPTION", RST);
+  for (i = 0; i < n; i++) {
+    long ok = h->total - r[i].missing;
+    outf("%s%-3u %s%-10s%s %+5d %7ld%% %10.2f  %s\n", INDENT, i + 1, r[i].missing ? ERR : ACC,
+         INST[r[i].inst].name, RST, r[i].transpose, ok * 100 / h->total,
+         ok ? (double)r[i].cost / ok : 0.0, INST[r[i].inst].descr);
+  }
+}
+
+/* Pick the harmonica key that needs the least bends to play the music */
+static void harp_auto(struct instr *instr, struct hist *h, int transpose) {
+  static const int keys[] = {0, 7, 9, 2, 5, 10, 4, 3, 8, 11, 1, 6}; /* Most common first */
+  struct rank best, cur;
+  int i, key = 0;
+  for (i = 0; i < 12; i++) {
+    harp_key((struct harp *)instr->ctx, keys[i]);
+    rank_eval(instr, h, transpose, &cur);
+    if (i == 0 || rank_cmp(&cur, &best) < 0) {
+      best = cur;
+      key = keys[i];
+    }
+  }
+  harp_key((struct harp *)instr->ctx, key);
+  outf("%s%sHarmonica in %s%s\n", INDENT, TXT, NOTES[key], RST);
+}
+
+/* Best capo and transposition of a tuning */
+struct retune {
+  int tuning; /* Index in TUNINGS */
+  int capo;
+  int transpose;
+  long missing; /* Number of unplayable notes */
+  int span;     /* Distance between the lowest and the highest fretted note */
+  long cost;    /* Total of all frets */
+};
+
+static int retune_cmp(const void *a, const void *b) {
+  const struct retune *x = (const struct retune *)a, *y = (const struct retune *)b;
+  if (x->missing != y->missing) return x->missing < y->missing ? -1 : 1;
+  if (x->span != y->span) return x->span - y->span;
+  if (x->cost != y->cost) return x->cost < y->cost ? -1 : 1;
+  if (abs(x->transpose) != abs(y->transpose)) return abs(x->transpose) - abs(y->transpose);
+  return x->capo - y->capo;
+}
+
+/* Find the best capo and transposition for every alternate tuning of the
+ * instrument and print them ranked. A fret only depends on the distance of a
+ * note to the open strings, so a capo is the same as transposing the music
+ * down: frets of every note are computed once per tuning and each shift is
+ * scored over the distinct notes of the music. Shifts that put the lowest
+ * note below the lowest string are skipped once a fully playable one is
+ * found, and scoring stops as soon as a shift is worse than the best one. */
+#define MAXCAPO 7
+static void retune(struct frets *f, struct hist *h) {
+  struct retune r[NTUNINGS], best, cur;
+  int i, n, j, s, k, lo, lowest, notes[NNOTES], nnotes = 0, pc[NSTRINGS];
+  int roots[NSTRINGS], fret[NNOTES];
+  char letters[NSTRINGS], label[8];
+  for (i = 0; i < NNOTES; i++) {
+    if (h->n[i]) notes[nnotes++] = i;
+  }
+  if (nnotes == 0) {
+    outf("%sNo notes found\n", INDENT);
+    return;
+  }
+  lo = notes[0];
+  for (i = n = 0; i < NTUNINGS; i++) {
+    int ns = tuning_parse(TUNINGS[i].notes, pc, letters);
+    if (TUNINGS[i].f != f || ns != f->n) continue;
+    /* The tuning comes from the instrument defaults, without the capo */
+    for (j = 0; j < ns; j++) pc[j] = (pc[j] + f->capo) % 12;
+    tuning_roots(f, pc, ns, roots);
+    for (j = 0, lowest = NNOTES; j < ns; j++) {
+      roots[j] -= f->capo;
+      if (roots[j] < lowest) lowest = roots[j];
+    }
+    for (k = 0; k < NNOTES; k++) {
+      fret[k] = -1;
+      for (j = 0; j < ns; j++) {
+        if (k >= roots[j] && (fret[k] < 0 || k - roots[j] < fret[k])) fret[k] = k - roots[j];
+      }
+      if (fret[k] < 0) continue;
+      frets_label(f, fret[k], label, sizeof(label));
+      if (!label[0]) fret[k] = -1;
+    }
+    best.missing = -1;
+    for (s = -24 - MAXCAPO; s <= 24; s++) {
+      int flo = -1, fhi = 0;
+      if (best.missing == 0 && lo + s < lowest) continue;
+      cur.tuning = i;
+      cur.missing = cur.cost = 0;
+      for (j = 0; j < nnotes && (best.missing < 0 || cur.missing <= best.missing); j++) {
+        int t = notes[j] + s, fr = t >= 0 && t < NNOTES ? fret[t] : -1;
+        if (fr < 0) {
+          cur.missing += h->n[notes[j]];
+        } else {
+          cur.cost += h->n[notes[j]] * fr;
+          if (fr > 0 && (flo < 0 || fr < flo)) flo = fr;
+          if (fr > fhi) fhi = fr;
+        }
+      }
+      if (j < nnotes) continue;
+      cur.span = flo < 0 ? 0 : fhi - flo;
+      /* Keep the key of the music with a capo if possible */
+      for (k = 0; k <= MAXCAPO; k++) {
+        cur.capo = k;
+        cur.transpose = s + k;
+        if (cur.transpose >= -24 && cur.transpose <= 24 &&
+            (best.missing < 0 || retune_cmp(&cur, &best) < 0)) {
+          best = cur;
+        }
+      }
+    }
+    if (best.missing >= 0) r[n++] = best;
+  }
+  if (n == 0) {
+    outf("%sNo alternate tunings for the instrument\n", INDENT);
+    return;
+  }
+  qsort(r, n, sizeof(r[0]), retune_cmp);
+  outf("%s%s%-3s %-10s %-14s %4s %5s %8s %5s %10s%s\n", INDENT, DIM, "#", "NAME", "TUNING",
+       "CAPO", "-t", "PLAYABLE", "SPAN", "DIFFICULTY", RST);
+  for (i = 0; i < n; i++) {
+    long ok = h->total - r[i].missing;
+    outf("%s%-3d %s%-10s%s %-14s %4d %+5d %7ld%% %5d %10.2f\n", INDENT, i + 1,
+         r[i].missing ? ERR : ACC, TUNINGS[r[i].tuning].name, RST, TUNINGS[r[i].tuning].notes,
+         r[i].capo, r[i].transpose, ok * 100 / h->total, r[i].span,
+         ok ? (double)r[i].cost / ok : 0.0);
+  }
+}
+
+/* Apply instrument options, like a harmonica key in "-i harp:G" or a tuning in
+ * "-i guitar:DADGAD" */
+static int instr_option(struct instr *instr, const char *opt, struct instr **autoharp) {
+  int key;
+  if (instr->note == harp_note) {
+    if (strcmp(opt, "auto") == 0) {
+      *autoharp = instr;
+    } else if (chord_parse(opt, strlen(opt), &key) == 0) {
+      harp_key((struct harp *)instr->ctx, key);
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+  if (instr->note == frets_note) return frets_tune((struct frets *)instr->ctx, opt, 0);
+  return -1;
+}
+
+/* Pipes can't be read twice, returns a temporary copy of the input if needed */
+static FILE *seekable(FILE *f, long *start) {
+  FILE *tmp;
+  char buf[LINESZ];
+  size_t n;
+  *start = ftell(f);
+  if (*start >= 0 && fseek(f, *start, SEEK_SET) == 0) return NULL;
+  if ((tmp = tmpfile()) == NULL) {
+    perror("tmpfile");
+    exit(1);
+  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) fwrite(buf, 1, n, tmp);
+  *start = 0;
+  return tmp;
+}
+
+/* Pick the harmonica key for the rest of the file */
+static void tabs_autoharp(FILE *f, struct instr *autoharp, int transpose) {
+  struct hist h;
+  long start = ftell(f);
+  memset(&h, 0, sizeof(h));
+  hist_abc(f, &h);
+  fseek(f, start, SEEK_SET);
+  harp_auto(autoharp, &h, transpose);
+}
+
+/* Render a file, picking the harmonica key first if needed */
+static void tabs_begin(struct instr *instr) {
+  outs(VINDENT);
+  if (instr->note == wav_note) instr = ((struct wav *)instr->ctx)->instr;
+  if (instr->note == frets_note && ((struct frets *)instr->ctx)->capo) {
+    outf("%s%sCapo %d%s\n", INDENT, TXT, ((struct frets *)instr->ctx)->capo, RST);
+  }
+}
+
+static void tabs_file(FILE *f, struct instr *instr, int transpose, struct instr *autoharp) {
+  tabs_begin(instr);
+  if (autoharp) {
+    long start;
+    FILE *tmp = seekable(f, &start);
+    if (tmp) f = tmp;
+    fseek(f, start, SEEK_SET);
+    tabs_autoharp(f, autoharp, transpose);
+    tabs_abc(f, instr, transpose);
+    if (tmp) fclose(tmp);
+    return;
+  }
+  tabs_abc(f, instr, transpose);
+}
+
+/* ------------------------ Interactive viewer -------------------------- */
+
+/* The viewer renders only the stanzas that scroll into view, so the first
+ * screen shows up at once regardless of the file size. Stanza offsets are
+ * indexed lazily while scrolling, piped input is spooled into a temporary
+ * file as it is indexed. Rendered stanzas are kept in a small LRU cache keyed
+ * by the instrument and transposition. */
+#define NCACHE 16 /* Rendered stanzas to keep */
+#define STANZA 64 /* Max lines of a stanza without blank lines */
+
+struct stanza {
+  long n; /* Stanza number, -1 if the slot is empty */
+  struct instr *instr;
+  int transpose;
+  unsigned long used; /* Last use, for LRU eviction */
+  struct out o;       /* Rendered text */
+  int nlines;
+};
+
+struct viewer {
+  FILE *f;
+  FILE *in; /* Piped input, copied to f while indexing, or NULL */
+  const char *name;
+  long *off;    /* Stanza offsets, off[n] is where indexing continues */
+  long n, cap;  /* Number of indexed stanzas */
+  int eof;      /* All stanzas are indexed */
+  unsigned long tick;
+  struct stanza cache[NCACHE];
+  unsigned inst; /* Current instrument, index in INST */
+  int transpose;
+  long top;     /* First stanza on the screen */
+  int line;     /* First line of the stanza on the screen */
+  int rows;
+};
+
+/* Index stanzas up to the given one, returns 0 if there is no such stanza */
+static int view_index(struct viewer *v, long n) {
+  char line[LINESZ];
+  while (!v->eof && v->n <= n) {
+    int lines = 0;
+    fseek(v->f, v->in ? 0 : v->off[v->n], v->in ? SEEK_END : SEEK_SET);
+    while (lines < STANZA && fgets(line, sizeof(line), v->in ? v->in : v->f)) {
+      if (v->in) fputs(line, v->f);
+      lines++;
+      if (isempty(line)) break;
+    }
+    if (lines == 0) {
+      v->eof = 1;
+      break;
+    }
+    if (v->n + 2 > v->cap) {
+      v->cap = v->cap * 2;
+      if ((v->off = realloc(v->off, v->cap * sizeof(long))) == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    v->off[++v->n] = ftell(v->f);
+  }
+  return n < v->n;
+}
+
+static struct stanza *view_render(struct viewer *v, long n) {
+  static struct voices vs;
+  static struct asciitab at;
+  char line[LINESZ];
+  struct instr *instr = INST[v->inst].instr;
+  struct stanza *st = &v->cache[0];
+  char *p, *end;
+  int i;
+  for (i = 0; i < NCACHE; i++) {
+    struct stanza *c = &v->cache[i];
+    if (c->n == n && c->instr == instr && c->transpose == v->transpose) {
+      c->used = ++v->tick;
+      return c;
+    }
+    if (c->used < st->used) st = c;
+  }
+  st->n = n;
+  st->instr = instr;
+  st->transpose = v->transpose;
+  st->used = ++v->tick;
+  st->o.len = 0;
+  out_cur = &st->o;
+  vs.n = vs.cur = 0;
+  fseek(v->f, v->off[n], SEEK_SET);
+  while (ftell(v->f) < v->off[n + 1] && fgets(line, sizeof(line), v->f)) {
+    tabs_line(&vs, &at, line, instr, v->transpose);
+  }
+  tabs_end(&vs, &at, instr, v->transpose);
+  out_cur = &stdout_out;
+  st->nlines = 0;
+  for (p = st->o.buf, end = p + st->o.len; p < end; p++) {
+    if ((p = memchr(p, '\n', end - p)) == NULL) p = end;
+    st->nlines++;
+  }
+  return st;
+}
+
+/* Find a line of a rendered stanza, returns its length without the newline */
+static size_t view_line(struct stanza *st, int i, char **line) {
+  char *p = st->o.buf, *end = p + st->o.len, *nl;
+  for (; i > 0; i--) p = (char *)memchr(p, '\n', end - p) + 1;
+  nl = memchr(p, '\n', end - p);
+  *line = p;
+  return (nl ? nl : end) - p;
+}
+
+static int view_down(struct viewer *v) {
+  for (;;) {
+    if (v->line + 1 < view_render(v, v->top)->nlines) {
+      v->line++;
+      return 1;
+    }
+    if (!view_index(v, v->top + 1)) return 0;
+    v->top++;
+    v->line = 0;
+    if (view_render(v, v->top)->nlines) return 1;
+  }
+}
+
+static int view_up(struct viewer *v) {
+  if (v->line > 0) {
+    v->line--;
+    return 1;
+  }
+  while (v->top > 0) {
+    struct stanza *st = view_render(v, --v->top);
+    if (st->nlines) {
+      v->line = st->nlines - 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void view_draw(struct viewer *v) {
+  struct winsize ws;
+  long n = v->top;
+  int i = v->line, row = 0;
+  v->rows = 24;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 1) v->rows = ws.ws_row;
+  outs("\x1b[H");
+  for (; row < v->rows - 1 && view_index(v, n); n++, i = 0) {
+    struct stanza *st = view_render(v, n);
+    for (; i < st->nlines && row < v->rows - 1; i++, row++) {
+      char *line;
+      size_t len = view_line(st, i, &line);
+      out(line, len);
+      outs(RST);
+      outs("\x1b[K\n");
+    }
+  }
+  for (; row < v->rows - 1; row++) outs("\x1b[K\n");
+  outf("\x1b[7m %s  %s  %+d  %ld/%ld%s  [j/k/space/b/g/G] scroll [i/I] instrument [+/-] transpose "
+       "[q] quit\x1b[0m\x1b[K",
+       v->name, INST[v->inst].name, v->transpose, v->top + 1, v->n, v->eof ? "" : "+");
+  out_flush();
+}
+
+/* Read a key press, arrow and page keys are mapped to letters */
+static int view_key(int tty) {
+  char c[3];
+  if (read(tty, c, 1) != 1) return 'q';
+  if (c[0] != '\x1b') return c[0];
+  if (read(tty, c, 2) != 2 || c[0] != '[') return 0;
+  switch (c[1]) {
+    case 'A': return 'k';
+    case 'B': return 'j';
+    case 'H': return 'g';
+    case 'F': return 'G';
+    case '5': return read(tty, c, 1) == 1 ? 'b' : 0;
+    case '6': return read(tty, c, 1) == 1 ? ' ' : 0;
+  }
+  return 0;
+}
+
+static void view(FILE *f, const char *name, struct instr *instr, int transpose,
+                 struct instr *autoharp) {
+  static struct viewer v;
+  struct termios saved, raw;
+  struct out scratch = {NULL, 0, 0, -1};
+  long start = ftell(f);
+  int i, tty;
+  FILE *tmp = NULL;
+  if (start < 0 || fseek(f, start, SEEK_SET) != 0) {
+    if ((tmp = tmpfile()) == NULL) {
+      perror("tmpfile");
+      exit(1);
+    }
+    start = 0;
+  }
+  if ((tty = open("/dev/tty", O_RDONLY)) < 0 || tcgetattr(tty, &saved) < 0) {
+    perror("/dev/tty");
+    exit(1);
+  }
+  v.f = tmp ? tmp : f;
+  v.in = tmp ? f : NULL;
+  v.name = name;
+  v.cap = 1024;
+  if ((v.off = malloc(v.cap * sizeof(long))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  v.off[0] = start;
+  v.transpose = transpose;
+  for (i = 0; i < NCACHE; i++) {
+    v.cache[i].n = -1;
+    v.cache[i].o.fd = -1;
+  }
+  for (v.inst = 0; v.inst < NINST && INST[v.inst].instr != instr; v.inst++);
+  if (v.inst == NINST) v.inst = 0;
+  if (autoharp) {
+    /* The key is picked from the whole file, the message is not shown */
+    out_cur = &scratch;
+    if (v.in) view_index(&v, LONG_MAX);
+    fseek(v.f, start, SEEK_SET);
+    tabs_autoharp(v.f, autoharp, transpose);
+    out_cur = &stdout_out;
+    free(scratch.buf);
+  }
+
+  raw = saved;
+  raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(tty, TCSAFLUSH, &raw);
+  outs("\x1b[?1049h\x1b[?7l\x1b[?25l"); /* Alternate screen, no line wrapping, no cursor */
+  for (;;) {
+    view_draw(&v);
+    switch (view_key(tty)) {
+      case 'q':
+      case 3: goto done;
+      case 'j':
+      case '\n': view_down(&v); break;
+      case 'k': view_up(&v); break;
+      case ' ':
+      case 'f':
+        for (i = 0; i < v.rows - 2 && view_down(&v); i++);
+        break;
+      case 'b':
+        for (i = 0; i < v.rows - 2 && view_up(&v); i++);
+        break;
+      case 'g':
+        v.top = v.line = 0;
+        break;
+      case 'G':
+        view_index(&v, LONG_MAX);
+        v.top = v.n > 0 ? v.n - 1 : 0;
+        v.line = v.n > 0 ? view_render(&v, v.top)->nlines - 1 : 0;
+        if (v.line < 0) v.line = 0;
+        for (i = 0; i < v.rows - 2 && view_up(&v); i++);
+        break;
+      case 'i': v.inst = (v.inst + 1) % NINST; break;
+      case 'I': v.inst = (v.inst + NINST - 1) % NINST; break;
+      case '+':
+        if (v.transpose < 24) v.transpose++;
+        break;
+      case '-':
+        if (v.transpose > -24) v.transpose--;
+        break;
+    }
+    if (view_index(&v, v.top) && v.line >= view_render(&v, v.top)->nlines) v.line = 0;
+  }
+done:
+  outs("\x1b[?25h\x1b[?7h\x1b[?1049l");
+  out_flush();
+  tcsetattr(tty, TCSAFLUSH, &saved);
+  close(tty);
+  for (i = 0; i < NCACHE; i++) free(v.cache[i].o.buf);
+  free(v.off);
+  if (tmp) fclose(tmp);
+}
+
+/* --------------------------- Melody search ----------------------------- */
+
+/* The search index maps every three consecutive melody intervals (four notes,
+ * so matches don't depend on the key) to the lines where they occur. It is a
+ * single file in the indexed directory, used via mmap as is: a header with
+ * the build time, the indexed files with their sizes and modification times,
+ * a table of posting ranges per interval triple, postings sorted by file and
+ * line, and the file names. Files that did not change keep their postings on
+ * updates. */
+#define NGRAMS (25 * 25 * 25) /* Intervals of -12..+12 semitones, three per gram */
+#define INDEXFILE ".tabindex"
+#define NRESULTS 20
+
+struct idxhdr {
+  char magic[8];
+  unsigned nfiles;
+  unsigned npostings;
+  unsigned strsize;
+  unsigned built; /* Time of the build, files changed since are read again */
+};
+
+struct idxfile {
+  unsigned path; /* Offset in the string table */
+  unsigned size;
+  unsigned mtime;
+};
+
+struct posting {
+  unsigned file;
+  unsigned line;
+};
+
+struct gram {
+  unsigned gram;
+  struct posting p;
+};
+
+/* Note recorder, collects the interval grams of a melody */
+struct melody {
+  int n;       /* Notes of the tune so far */
+  int last[4]; /* Last four notes */
+  int chord;   /* Inside a chord only its first note is a part of the melody */
+  struct posting at;
+  struct gram *g;
+  size_t len, cap;
+};
+
+static void melody_reset(void *ctx) { (void)ctx; }
+
+static void melody_sym(void *ctx, int c) {
+  struct melody *m = (struct melody *)ctx;
+  if (c == '[' || c == ']') m->chord = c == '[';
+}
+
+static void melody_note(void *ctx, int c) {
+  struct melody *m = (struct melody *)ctx;
+  int i, d, gram = 0;
+  if (m->chord > 1) return;
+  if (m->chord) m->chord = 2;
+  memmove(m->last, m->last + 1, 3 * sizeof(int));
+  m->last[3] = c;
+  if (++m->n < 4) return;
+  for (i = 0; i < 3; i++) {
+    d = m->last[i + 1] - m->last[i];
+    gram = gram * 25 + (d < -12 ? -12 : d > 12 ? 12 : d) + 12;
+  }
+  if (m->len == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 1024;
+    m->g = xrealloc(m->g, m->cap * sizeof(m->g[0]));
+  }
+  m->g[m->len].gram = gram;
+  m->g[m->len++].p = m->at;
+}
+
+/* Tunes start at X: fields or at "## Title ##" headings */
+static int istune(const char *line) {
+  return strncmp(line, "X:", 2) == 0 || strncmp(line, "## ", 3) == 0;
+}
+
+/* Collect the melody of a file */
+static void melody_abc(FILE *f, struct melody *m, unsigned file) {
+  char line[LINESZ];
+  struct instr instr = {melody_reset, melody_sym, melody_note, NULL, NULL, NULL};
+  static struct asciitab at;
+  instr.ctx = m;
+  m->n = m->chord = 0;
+  m->at.file = file;
+  for (m->at.line = 1; fgets(line, sizeof(line), f); m->at.line++) {
+    if (istune(line)) m->n = 0;
+    if (!asciitab_line(&at, line, &instr, 0) && isabc(line)) abc_line(line, &instr, 0);
+  }
+  asciitab_flush(&at, &instr, 0);
+}
+
+struct index {
+  struct idxhdr *hdr;
+  size_t size;
+  struct idxfile *files;
+  unsigned *grams; /* Posting ranges, NGRAMS + 1 */
+  struct posting *postings;
+  char *strings;
+};
+
+/* The index is used as is, so every count and offset is checked against the
+ * mapped size before the tables are set up */
+static int index_check(struct index *idx) {
+  struct idxhdr *h = idx->hdr;
+  size_t left = idx->size - sizeof(*h);
+  unsigned i;
+  if (memcmp(h->magic, "TABIDX3", 8) != 0 || h->nfiles > left / sizeof(struct idxfile)) return -1;
+  left -= h->nfiles * sizeof(struct idxfile);
+  if (left / sizeof(unsigned) < NGRAMS + 1) return -1;
+  left -= (NGRAMS + 1) * sizeof(unsigned);
+  if (h->npostings > left / sizeof(struct posting)) return -1;
+  left -= h->npostings * sizeof(struct posting);
+  if (left != h->strsize) return -1;
+  idx->files = (struct idxfile *)(h + 1);
+  idx->grams = (unsigned *)(idx->files + h->nfiles);
+  idx->postings = (struct posting *)(idx->grams + NGRAMS + 1);
+  idx->strings = (char *)(idx->postings + h->npostings);
+  /* Posting ranges go up to the end, postings and names point inside */
+  for (i = 0; i < NGRAMS; i++) {
+    if (idx->grams[i] > idx->grams[i + 1]) return -1;
+  }
+  if (idx->grams[0] != 0 || idx->grams[NGRAMS] != h->npostings) return -1;
+  for (i = 0; i < h->npostings; i++) {
+    if (idx->postings[i].file >= h->nfiles) return -1;
+  }
+  if (h->nfiles && (h->strsize == 0 || idx->strings[h->strsize - 1] != 0)) return -1;
+  for (i = 0; i < h->nfiles; i++) {
+    if (idx->files[i].path >= h->strsize) return -1;
+  }
+  return 0;
+}
+
+static int index_open(struct index *idx, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  memset(idx, 0, sizeof(*idx));
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct idxhdr)) {
+    close(fd);
+    return -1;
+  }
+  idx->size = st.st_size;
+  idx->hdr = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (idx->hdr == MAP_FAILED) return -1;
+  if (index_check(idx) < 0) {
+    munmap(idx->hdr, idx->size);
+    idx->hdr = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void index_close(struct index *idx) {
+  if (idx->hdr) munmap(idx->hdr, idx->size);
+}
+
+/* Indexed files are sorted by path, so old and new ones can be matched in a
+ * single pass */
+struct idxent {
+  char *path;
+  unsigned size;
+  unsigned mtime;
+};
+
+struct idxbuild {
+  struct idxent *files;
+  unsigned nfiles, cap;
+};
+
+static int idxent_cmp(const void *a, const void *b) {
+  return strcmp(((const struct idxent *)a)->path, ((const struct idxent *)b)->path);
+}
+
+/* Path of an indexed file, relative paths are kept in the index so it works
+ * from any directory */
+static char *index_path(const char *dir, const char *rel, char *path, size_t sz) {
+  if (strcmp(dir, ".") == 0) {
+    snprintf(path, sz, "%s", rel);
+  } else {
+    snprintf(path, sz, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", rel);
+  }
+  return path;
+}
+
+/* Collect the .abc and .txt files below dir/rel, rel is empty at the top.
+ * Symlinks to files are followed, but not to directories, so links can't make
+ * the walk loop. */
+static void index_walk(struct idxbuild *b, const char *dir, const char *rel) {
+  DIR *d;
+  struct dirent *e;
+  struct stat st;
+  char path[4096], name[4096];
+  if ((d = opendir(index_path(dir, rel[0] ? rel : ".", path, sizeof(path)))) == NULL) {
+    perror(path);
+    return;
+  }
+  while ((e = readdir(d)) != NULL) {
+    size_t n = strlen(e->d_name);
+    if (e->d_name[0] == '.') continue;
+    if ((size_t)snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", e->d_name) >=
+        sizeof(name)) {
+      continue;
+    }
+    if (lstat(index_path(dir, name, path, sizeof(path)), &st) < 0) continue;
+    if (S_ISLNK(st.st_mode) && (stat(path, &st) < 0 || S_ISDIR(st.st_mode))) continue;
+    if (S_ISDIR(st.st_mode)) {
+      index_walk(b, dir, name);
+      continue;
+    }
+    if (!S_ISREG(st.st_mode) || n < 4 ||
+        (strcmp(e->d_name + n - 4, ".abc") && strcmp(e->d_name + n - 4, ".txt"))) {
+      continue;
+    }
+    if (b->nfiles == b->cap) {
+      b->cap = b->cap ? b->cap * 2 : 256;
+      b->files = xrealloc(b->files, b->cap * sizeof(b->files[0]));
+    }
+    b->files[b->nfiles].path = strcpy(xrealloc(NULL, strlen(name) + 1), name);
+    b->files[b->nfiles].size = st.st_size;
+    b->files[b->nfiles++].mtime = st.st_mtime;
+  }
+  closedir(d);
+}
+
+static int posting_cmp(const void *a, const void *b) {
+  const struct posting *x = (const struct posting *)a, *y = (const struct posting *)b;
+  if (x->file != y->file) return x->file < y->file ? -1 : 1;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* Build or update the index of a directory */
+static int index_dir(const char *dir) {
+  struct idxbuild b;
+  struct index old;
+  struct melody m;
+  struct idxhdr hdr;
+  struct posting *postings;
+  struct idxfile file;
+  unsigned *grams, *reuse, i, j, k, reused = 0;
+  char path[4096], tmp[4096], name[4096];
+  FILE *f;
+  time_t built = time(NULL);
+  memset(&b, 0, sizeof(b));
+  memset(&m, 0, sizeof(m));
+  index_walk(&b, dir, "");
+  qsort(b.files, b.nfiles, sizeof(b.files[0]), idxent_cmp);
+  snprintf(path, sizeof(path), "%s/%s", dir, INDEXFILE);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  /* Old file ids of the files that did not change, or -1 */
+  reuse = xrealloc(NULL, (b.nfiles + 1) * sizeof(unsigned));
+  for (i = 0; i < b.nfiles; i++) reuse[i] = -1U;
+  if (index_open(&old, path) == 0) {
+    unsigned *map = xrealloc(NULL, (old.hdr->nfiles + 1) * sizeof(unsigned));
+    for (j = 0; j < old.hdr->nfiles; j++) map[j] = -1U;
+    for (i = 0, k = 0; i < b.nfiles && k < old.hdr->nfiles;) {
+      int cmp = strcmp(b.files[i].path, old.strings + old.files[k].path);
+      /* A file changed in the second of the last build may have changed after it */
+      if (cmp == 0 && old.files[k].size == b.files[i].size &&
+          old.files[k].mtime == b.files[i].mtime && b.files[i].mtime < old.hdr->built) {
+        reuse[i] = k;
+        map[k] = i;
+        reused++;
+      }
+      i = i + (cmp <= 0);
+      k = k + (cmp >= 0);
+    }
+    for (k = 0; k < NGRAMS; k++) {
+      for (j = old.grams[k]; j < old.grams[k + 1]; j++) {
+        struct posting p = old.postings[j];
+        if (map[p.file] == -1U) continue;
+        p.file = map[p.file];
+        m.at = p;
+        if (m.len == m.cap) {
+          m.cap = m.cap ? m.cap * 2 : 1024;
+          m.g = xrealloc(m.g, m.cap * sizeof(m.g[0]));
+        }
+        m.g[m.len].gram = k;
+        m.g[m.len++].p = p;
+      }
+    }
+    free(map);
+    index_close(&old);
+  }
+  for (i = 0; i < b.nfiles; i++) {
+    if (reuse[i] != -1U) continue;
+    if ((f = fopen(index_path(dir, b.files[i].path, name, sizeof(name)), "r")) == NULL) {
+      perror(name);
+      continue;
+    }
+    melody_abc(f, &m, i);
+    fclose(f);
+  }
+
+  /* Counting sort by gram, then by file and line, dropping duplicates */
+  grams = xrealloc(NULL, (NGRAMS + 1) * sizeof(unsigned));
+  memset(grams, 0, (NGRAMS + 1) * sizeof(unsigned));
+  for (i = 0; i < m.len; i++) grams[m.g[i].gram + 1]++;
+  for (k = 0; k < NGRAMS; k++) grams[k + 1] += grams[k];
+  postings = xrealloc(NULL, (m.len + 1) * sizeof(struct posting));
+  for (i = 0; i < m.len; i++) postings[grams[m.g[i].gram]++] = m.g[i].p;
+  for (k = NGRAMS; k > 0; k--) grams[k] = grams[k - 1];
+  grams[0] = 0;
+  for (k = 0, j = 0; k < NGRAMS; k++) {
+    unsigned start = j;
+    qsort(postings + grams[k], grams[k + 1] - grams[k], sizeof(struct posting), posting_cmp);
+    for (i = grams[k]; i < grams[k + 1]; i++) {
+      if (j > start && posting_cmp(&postings[j - 1], &postings[i]) == 0) continue;
+      postings[j++] = postings[i];
+    }
+    grams[k] = start;
+  }
+  grams[NGRAMS] = j;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "TABIDX3", 8);
+  hdr.built = built;
+  hdr.nfiles = b.nfiles;
+  hdr.npostings = j;
+  for (i = 0; i < b.nfiles; i++) hdr.strsize += strlen(b.files[i].path) + 1;
+  if ((f = fopen(tmp, "wb")) == NULL) {
+    perror(tmp);
+    return -1;
+  }
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  for (i = 0, file.path = 0; i < b.nfiles; i++) {
+    file.size = b.files[i].size;
+    file.mtime = b.files[i].mtime;
+    fwrite(&file, sizeof(file), 1, f);
+    file.path += strlen(b.files[i].path) + 1;
+  }
+  fwrite(grams, sizeof(unsigned), NGRAMS + 1, f);
+  fwrite(postings, sizeof(struct posting), j, f);
+  for (i = 0; i < b.nfiles; i++) fwrite(b.files[i].path, 1, strlen(b.files[i].path) + 1, f);
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    perror(path);
+    return -1;
+  }
+  outf("%sIndexed %u files (%u unchanged), %u postings\n", INDENT, b.nfiles, reused, j);
+  free(grams);
+  free(postings);
+  free(reuse);
+  free(m.g);
+  for (i = 0; i < b.nfiles; i++) free(b.files[i].path);
+  free(b.files);
+  return 0;
+}
+
+/* Title of a tune from a T: field or a heading, if the line is one */
+static void tune_title(const char *line, char *title, size_t sz) {
+  const char *p;
+  char *e;
+  if (strncmp(line, "T:", 2) == 0 || strncmp(line, "## ", 3) == 0) {
+    p = line + 2 + strspn(line + 2, "# ");
+    snprintf(title, sz, "%.*s", (int)strcspn(p, "#\r\n"), p);
+    for (e = title + strlen(title); e > title && e[-1] == ' '; e--) e[-1] = 0;
+  }
+}
+
+/* Title of the tune around a line: its first T: field or its heading */
+static void index_title(const char *path, unsigned n, char *title, size_t sz) {
+  char line[LINESZ];
+  unsigned i;
+  FILE *f = fopen(path, "r");
+  title[0] = 0;
+  for (i = 1; f && i <= n && fgets(line, sizeof(line), f); i++) {
+    if (istune(line)) title[0] = 0;
+    if (title[0] == 0) tune_title(line, title, sz);
+  }
+  if (f) fclose(f);
+}
+
+struct match {
+  struct posting p;
+  unsigned score; /* Number of query grams found on the line */
+};
+
+/* Find the lines sharing the most interval grams with the query. Posting
+ * lists of all query grams are merged, they are sorted by file and line. */
+static int index_search(const char *dir, char *query) {
+  struct index idx;
+  struct melody m;
+  struct instr instr = {melody_reset, melody_sym, melody_note, NULL, NULL, NULL};
+  struct match top[NRESULTS + 1];
+  unsigned *pos, *end, i, j, n, ntop = 0, distinct = 0;
+  char path[4096], title[LINESZ], *line = xrealloc(NULL, strlen(query) + 2);
+  snprintf(path, sizeof(path), "%s/%s", dir, INDEXFILE);
+  if (index_open(&idx, path) < 0) {
+    fprintf(stderr, "%s: no index, build it with -x %s\n", path, dir);
+    return -1;
+  }
+  memset(&m, 0, sizeof(m));
+  instr.ctx = &m;
+  sprintf(line, "%s\n", query);
+  abc_line(line, &instr, 0);
+  free(line);
+  if (m.len == 0) {
+    fprintf(stderr, "The query should have at least 4 notes\n");
+    return -1;
+  }
+  pos = xrealloc(NULL, m.len * sizeof(unsigned));
+  end = xrealloc(NULL, m.len * sizeof(unsigned));
+  for (i = 0; i < m.len; i++) {
+    pos[i] = idx.grams[m.g[i].gram];
+    end[i] = idx.grams[m.g[i].gram + 1];
+    for (j = 0; j < i && m.g[j].gram != m.g[i].gram; j++);
+    if (j < i) pos[i] = end[i]; /* Count repeated grams once */
+    distinct += j == i;
+  }
+  for (;;) {
+    struct match cur;
+    int first = 1;
+    for (i = 0; i < m.len; i++) {
+      if (pos[i] < end[i] && (first || posting_cmp(&idx.postings[pos[i]], &cur.p) < 0)) {
+        cur.p = idx.postings[pos[i]];
+        first = 0;
+      }
+    }
+    if (first) break;
+    for (i = 0, cur.score = 0; i < m.len; i++) {
+      if (pos[i] < end[i] && posting_cmp(&idx.postings[pos[i]], &cur.p) == 0) {
+        pos[i]++;
+        cur.score++;
+      }
+    }
+    /* Keep the best matches, earlier ones first on equal scores */
+    for (n = ntop; n > 0 && top[n - 1].score < cur.score; n--) {
+      if (n < NRESULTS) top[n] = top[n - 1];
+    }
+    if (n < NRESULTS) {
+      top[n] = cur;
+      if (ntop < NRESULTS) ntop++;
+    }
+  }
+  if (ntop == 0) outf("%sNo matches found\n", INDENT);
+  for (i = 0; i < ntop; i++) {
+    const char *file = index_path(dir, idx.strings + idx.files[top[i].p.file].path, path,
+                                  sizeof(path));
+    index_title(file, top[i].p.line, title, sizeof(title));
+    outf("%s%s%3u%%%s %s", INDENT, top[i].score == distinct ? ACC : DIM,
+         top[i].score * 100 / distinct, RST, TXT);
+    outtext(file, strlen(file));
+    outf(":%u%s  ", top[i].p.line, RST);
+    outtext(title, strlen(title));
+    outs("\n");
+  }
+  free(pos);
+  free(end);
+  free(m.g);
+  index_close(&idx);
+  return 0;
+}
+
+/* -------------------------- Songbook archives -------------------------- */
+
+/* An archive packs the tunes of many files into a single file, used via mmap
+ * as is: a header, the tunes sorted by title, the tune numbers in the packing
+ * order, the titles and keys, and the text of all tunes. A tune is found by
+ * its title with a binary search or by its number, and rendered straight from
+ * the mapped text with no other I/O. */
+struct packhdr {
+  char magic[8];
+  unsigned ntunes;
+  unsigned strsize;
+  unsigned datasize;
+};
+
+struct packtune {
+  unsigned title; /* Offsets in the string table */
+  unsigned key;
+  unsigned offset; /* Text of the tune in the data */
+  unsigned len;
+  unsigned n; /* Tune number, in the packing order */
+};
+
+struct pack {
+  struct packhdr *hdr;
+  size_t size;
+  struct packtune *tunes; /* Sorted by title */
+  unsigned *order;        /* Indices of the tunes by number */
+  char *strings;
+  char *data;
+};
+
+/* Like the index, an archive is checked against the mapped size before use */
+static int pack_check(struct pack *p) {
+  struct packhdr *h = p->hdr;
+  size_t left = p->size - sizeof(*h);
+  unsigned i;
+  if (memcmp(h->magic, "TABPAK1", 8) != 0 ||
+      h->ntunes > left / (sizeof(struct packtune) + sizeof(unsigned))) {
+    return -1;
+  }
+  left -= h->ntunes * (sizeof(struct packtune) + sizeof(unsigned));
+  if (h->strsize > left || left - h->strsize != h->datasize) return -1;
+  p->tunes = (struct packtune *)(h + 1);
+  p->order = (unsigned *)(p->tunes + h->ntunes);
+  p->strings = (char *)(p->order + h->ntunes);
+  p->data = p->strings + h->strsize;
+  if (h->ntunes && (h->strsize == 0 || p->strings[h->strsize - 1] != 0)) return -1;
+  for (i = 0; i < h->ntunes; i++) {
+    struct packtune *t = &p->tunes[i];
+    if (t->title >= h->strsize || t->key >= h->strsize || t->offset > h->datasize ||
+        t->len > h->datasize - t->offset || p->order[i] >= h->ntunes) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int pack_open(struct pack *p, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  memset(p, 0, sizeof(*p));
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct packhdr)) {
+    close(fd);
+    return -1;
+  }
+  p->size = st.st_size;
+  p->hdr = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p->hdr == MAP_FAILED) return -1;
+  if (pack_check(p) < 0) {
+    munmap(p->hdr, p->size);
+    p->hdr = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void pack_close(struct pack *p) {
+  if (p->hdr) munmap(p->hdr, p->size);
+}
+
+/* Find a tune by its number, or by its title or the beginning of it */
+static struct packtune *pack_find(struct pack *p, const char *name) {
+  unsigned lo = 0, hi = p->hdr->ntunes, mid;
+  if (isdigit(*name) && name[strspn(name, "0123456789")] == '\0') {
+    unsigned long n = strtoul(name, NULL, 10);
+    return n >= 1 && n <= hi ? &p->tunes[p->order[n - 1]] : NULL;
+  }
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (strcmp(p->strings + p->tunes[mid].title, name) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < p->hdr->ntunes &&
+      strncmp(p->strings + p->tunes[lo].title, name, strlen(name)) == 0) {
+    return &p->tunes[lo];
+  }
+  return NULL;
+}
+
+struct packbuild {
+  struct packtune *tunes;
+  unsigned ntunes, cap;
+  char *strings, *data;
+  size_t strsize, strcap, datasize, datacap;
+};
+
+static void pack_append(char **buf, size_t *size, size_t *cap, const char *s, size_t len) {
+  if (*size + len > *cap) {
+    for (*cap = *cap ? *cap : 65536; *size + len > *cap;) *cap *= 2;
+    *buf = xrealloc(*buf, *cap);
+  }
+  memcpy(*buf + *size, s, len);
+  *size += len;
+}
+
+/* Add the tune read so far, its text ends at the current end of the data */
+static void pack_tune(struct packbuild *b, const char *path, const char *title, const char *key,
+                      unsigned offset) {
+  struct packtune *t;
+  const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  if (b->ntunes == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 256;
+    b->tunes = xrealloc(b->tunes, b->cap * sizeof(b->tunes[0]));
+  }
+  t = &b->tunes[b->ntunes];
+  t->n = b->ntunes++;
+  t->offset = offset;
+  t->len = b->datasize - offset;
+  t->title = b->strsize;
+  if (title[0]) {
+    pack_append(&b->strings, &b->strsize, &b->strcap, title, strlen(title) + 1);
+  } else {
+    /* Untitled tunes are named after the file */
+    pack_append(&b->strings, &b->strsize, &b->strcap, base, strcspn(base, "."));
+    pack_append(&b->strings, &b->strsize, &b->strcap, "", 1);
+  }
+  t->key = b->strsize;
+  pack_append(&b->strings, &b->strsize, &b->strcap, key, strlen(key) + 1);
+}
+
+/* Split a file into tunes at X: fields or headings, text before the first
+ * one goes with it */
+static void pack_file(struct packbuild *b, const char *path) {
+  char line[LINESZ], title[LINESZ] = "", key[LINESZ] = "", *p;
+  unsigned offset = b->datasize;
+  int tune = 0;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (istune(line)) {
+      if (tune) {
+        pack_tune(b, path, title, key, offset);
+        offset = b->datasize;
+      }
+      tune = 1;
+      title[0] = key[0] = 0;
+    }
+    if (title[0] == 0) tune_title(line, title, sizeof(title));
+    if (key[0] == 0 && strncmp(line, "K:", 2) == 0) {
+      p = line + 2 + strspn(line + 2, " ");
+      snprintf(key, sizeof(key), "%.*s", (int)strcspn(p, "%\r\n"), p);
+      for (p = key + strlen(key); p > key && p[-1] == ' '; p--) p[-1] = 0;
+    }
+    pack_append(&b->data, &b->datasize, &b->datacap, line, strlen(line));
+  }
+  if (b->datasize > offset) pack_tune(b, path, title, key, offset);
+  fclose(f);
+}
+
+static const char *pack_strings; /* String table of the tunes being sorted */
+
+static int packtune_cmp(const void *a, const void *b) {
+  const struct packtune *x = (const struct packtune *)a, *y = (const struct packtune *)b;
+  int cmp = strcmp(pack_strings + x->title, pack_strings + y->title);
+  return cmp ? cmp : x->n < y->n ? -1 : 1;
+}
+
+/* Pack files, and .abc and .txt files in directories, into an archive */
+static int pack_files(const char *path, int n, char **files) {
+  struct packbuild b;
+  struct packhdr hdr;
+  unsigned *order, i, j;
+  char tmp[4096];
+  struct stat st;
+  FILE *f;
+  memset(&b, 0, sizeof(b));
+  for (i = 0; (int)i < n; i++) {
+    if (stat(files[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      struct idxbuild d;
+      memset(&d, 0, sizeof(d));
+      index_walk(&d, files[i], "");
+      qsort(d.files, d.nfiles, sizeof(d.files[0]), idxent_cmp);
+      for (j = 0; j < d.nfiles; j++) {
+        pack_file(&b, index_path(files[i], d.files[j].path, tmp, sizeof(tmp)));
+        free(d.files[j].path);
+      }
+      free(d.files);
+    } else {
+      pack_file(&b, files[i]);
+    }
+  }
+  pack_strings = b.strings;
+  qsort(b.tunes, b.ntunes, sizeof(b.tunes[0]), packtune_cmp);
+  order = xrealloc(NULL, (b.ntunes + 1) * sizeof(unsigned));
+  for (i = 0; i < b.ntunes; i++) order[b.tunes[i].n] = i;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, "TABPAK1", 8);
+  hdr.ntunes = b.ntunes;
+  hdr.strsize = b.strsize;
+  hdr.datasize = b.datasize;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((f = fopen(tmp, "wb")) == NULL) {
+    perror(tmp);
+    return -1;
+  }
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(b.tunes, sizeof(b.tunes[0]), b.ntunes, f);
+  fwrite(order, sizeof(unsigned), b.ntunes, f);
+  fwrite(b.strings, 1, b.strsize, f);
+  fwrite(b.data, 1, b.datasize, f);
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    perror(path);
+    return -1;
+  }
+  outf("%sPacked %u tunes, %lu bytes\n", INDENT, b.ntunes, (unsigned long)b.datasize);
+  free(order);
+  free(b.tunes);
+  free(b.strings);
+  free(b.data);
+  return 0;
+}
+
+/* Render tunes of an archive by titles or numbers, or list all of them */
+static int pack_render(const char *path, int n, char **names, struct instr *instr,
+                       int transpose) {
+  struct pack p;
+  struct packtune *t;
+  const char *title, *key;
+  unsigned i;
+  int err = 0;
+  if (pack_open(&p, path) < 0) {
+    fprintf(stderr, "%s: not a tab archive\n", path);
+    return -1;
+  }
+  if (n == 0) {
+    outs(VINDENT);
+    outf("%s%s%-6s %-40s %s%s\n", INDENT, DIM, "#", "TITLE", "KEY", RST);
+    for (i = 0; i < p.hdr->ntunes; i++) {
+      t = &p.tunes[p.order[i]];
+      title = p.strings + t->title;
+      key = p.strings + t->key;
+      outf("%s%-6u %s", INDENT, i + 1, TXT);
+      outtext(title, strlen(title));
+      outf("%*s%s ", strlen(title) < 40 ? (int)(40 - strlen(title)) : 0, "", RST);
+      outtext(key, strlen(key));
+      outs("\n");
+    }
+  }
+  for (i = 0; (int)i < n; i++) {
+    if ((t = pack_find(&p, names[i])) == NULL) {
+      fprintf(stderr, "%s: no such tune: %s\n", path, names[i]);
+      err = -1;
+      continue;
+    }
+    tabs_begin(instr);
+    tabs_mem(p.data + t->offset, t->len, instr, transpose);
+  }
+  pack_close(&p);
+  return err;
+}
+
+static void usage(const char *argv0) {
+  unsigned int i;
+  fprintf(stderr, "USAGE: %s [-i inst] [-t steps] [file ...]\n", argv0);
+  fprintf(stderr, "\nOptions:\n\n");
+  fprintf(stderr, "  -i NAME\tSpecify the instrument for rendering tabs (see below)\n");
+  fprintf(stderr, "  -i harp:KEY\tHarmonica in the given key, or \"auto\" to pick the easiest\n");
+  fprintf(stderr, "  -i guitar:TUNE\tRetune strings by name (dadgad, openg, ...) or notes\n");
+  fprintf(stderr, "  -k FRET\tPlace a capo on a string instrument, frets count from the capo\n");
+  fprintf(stderr, "  -t NUM\tTranspose the music by NUM semitones\n");
+  fprintf(stderr, "  -F    \tFold notes by octaves into the range of the instrument\n");
+  fprintf(stderr, "  -r    \tRecommend instruments and transpositions for the music\n");
+  fprintf(stderr, "  -o    \tRank alternate tunings and capos of a string instrument\n");
+  fprintf(stderr, "  -v    \tView the tabs interactively, rendering only what is on the screen\n");
+  fprintf(stderr, "  -x DIR\tIndex the melodies of all .abc and .txt files in DIR for -s\n");
+  fprintf(stderr, "  -s NOTES\tFind songs with the melody in the index of DIR (default .)\n");
+  fprintf(stderr, "  -P FILE\tPack the tunes of all files and directories into an archive\n");
+  fprintf(stderr, "  -g FILE\tRender tunes of an archive by title or number, or list them\n");
+  fprintf(stderr, "  -w FILE\tAlso synthesize the music into a WAV file\n");
+  fprintf(stderr, "  -b BPM\tTempo of the WAV file in beats (notes) per minute\n");
+  fprintf(stderr, "  -c    \tForce colored output\n");
+  fprintf(stderr, "  -C    \tDisable colored output\n");
+  fprintf(stderr, "  -a    \tDisable unicode (use ASCII)\n");
+  fprintf(stderr, "  -f FMT\tOutput format: text, html or svg\n");
+  fprintf(stderr, "  -S    \tPrint rendering cache statistics\n");
+  fprintf(stderr, "  -h    \tShow this help\n");
+  fprintf(stderr, "\nInstruments:\n\n");
+  for (i = 0; i < NINST; i++) {
+    fprintf(stderr, "  * %-10s\t%s\n", INST[i].name, INST[i].descr);
+  }
+  fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+  int c;
+  int found = 0;
+  int colorize = 0;
+  int transpose = 0;
+  int padding = 2;
+  int recommending = 0;
+  int retuning = 0;
+  int capo = 0;
+  int err = 0;
+  char *packfile = NULL;
+  char *archive = NULL;
+  int viewing = 0;
+  int stats = 0;
+  char *indexdir = NULL;
+  char *query = NULL;
+  unsigned int t;
+  char *endp;
+  char *wavfile = NULL;
+  static struct wav wav;
+  struct instr wavinstr = {wav_reset, wav_sym, wav_note, wav_cost, wav_chord, NULL};
+  struct instr *instr = &guitar;
+  struct instr *autoharp = NULL;
+  char *opt;
+  char **args;
+  int nargs = 0;
+
+  wav.bpm = 120;
+
+  /* Files and names may come before the options, they are collected as they
+   * are met, "--" ends the options */
+  args = xrealloc(NULL, argc * sizeof(char *));
+  while (optind < argc) {
+    if (strcmp(argv[optind], "--") == 0) {
+      optind++;
+      break;
+    }
+    if (argv[optind][0] != '-' || argv[optind][1] == '\0') {
+      args[nargs++] = argv[optind++];
+      continue;
+    }
+    if ((c = getopt(argc, argv, "hCFScaorvP:b:f:g:i:k:p:s:t:w:x:")) == -1) break;
+    switch (c) {
+      case 'c': colorize = 1; break;
+      case 'C': decolorize(); break;
+      case 'a': asciify(); break;
+      case 'r': recommending = 1; break;
+      case 'o': retuning = 1; break;
+      case 'F': folding = 1; break;
+      case 'v': viewing = 1; break;
+      case 'S': stats = 1; break;
+      case 'x': indexdir = optarg; break;
+      case 's': query = optarg; break;
+      case 'w': wavfile = optarg; break;
+      case 'P': packfile = optarg; break;
+      case 'g': archive = optarg; break;
+      case 'f':
+        if (strcmp(optarg, "text") == 0) {
+          format = ANSI;
+        } else if (strcmp(optarg, "html") == 0) {
+          format = HTML;
+        } else if (strcmp(optarg, "svg") == 0) {
+          format = SVG;
+        } else {
+          fprintf(stderr, "%s: unknown format, should be text, html or svg, got %s\n", argv[0],
+                  optarg);
+          return 1;
+        }
+        break;
+      case 'b':
+        wav.bpm = strtol(optarg, &endp, 0);
+        if (endp == optarg || *endp != '\0' || wav.bpm < 10 || wav.bpm > 1000) {
+          fprintf(stderr, "%s: invalid tempo, should be 10..1000, got %s\n", argv[0], optarg);
+          return 1;
+        }
+        break;
+      case 'i':
+        if ((opt = strchr(optarg, ':')) != NULL) *opt++ = '\0';
+        for (t = 0; t < NINST; t++) {
+          if (strcmp(INST[t].name, optarg) == 0) {
+            instr = INST[t].instr;
+            found = 1;
+            break;
+          }
+        }
+        if (!found) {
+          fprintf(stderr, "Unknown instrument: %s\n", optarg);
+          return 1;
+        }
+        if (opt && instr_option(instr, opt, &autoharp) < 0) {
+          fprintf(stderr, "%s: invalid option for %s: %s\n", argv[0], optarg, opt);
+          return 1;
+        }
+        break;
+      case 't':
+        transpose = strtol(optarg, &endp, 0);
+        if (endp == optarg || *endp != '\0') {
+          fprintf(stderr, "%s: -t requires a number, got %s\n", argv[0], optarg);
+          return 1;
+        }
+        if (transpose < -24 || transpose > 24) {
+          fprintf(stderr, "%s: invalid transpose, should be -24..+24\n", argv[0]);
+          return 1;
+        }
+        break;
+      case 'k':
+        capo = strtol(optarg, &endp, 0);
+        if (endp == optarg || *endp != '\0' || capo < 0 || capo > 12) {
+          fprintf(stderr, "%s: invalid capo, should be 0..12, got %s\n", argv[0], optarg);
+          return 1;
+        }
+        break;
+      case 'p':
+        padding = strtol(optarg, &endp, 0);
+        if (endp == optarg || *endp != '\0') {
+          fprintf(stderr, "%s: -I requires a number, got %s\n", argv[0], optarg);
+          return 1;
+        }
+        if (padding < 0 || padding > 99) {
+          fprintf(stderr, "%s: invalid padding, should be 0..99\n", argv[0]);
+          return 1;
+        }
+        break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  while (optind < argc) args[nargs++] = argv[optind++];
+  memcpy(argv + argc - nargs, args, nargs * sizeof(char *));
+  optind = argc - nargs;
+  free(args);
+
+  if ((capo || retuning) && instr->note != frets_note) {
+    fprintf(stderr, "%s: -k and -o need a string instrument\n", argv[0]);
+    return 1;
+  }
+  if (capo) frets_tune((struct frets *)instr->ctx, NULL, capo);
+
+  if (format != ANSI) colorize = 1; /* Colors become CSS classes */
+  if ((!isatty(STDOUT_FILENO) || (getenv("NO_COLOR") != NULL && strcmp(getenv("NO_COLOR"), "0"))) &&
+      !colorize) {
+    decolorize();
+  }
+  if (format != ANSI) markup_styles();
+
+  stdout_out.tty = isatty(STDOUT_FILENO);
+  if (!stdout_out.tty) writer_start(STDOUT_FILENO);
+  atexit(out_close);
+  markup_begin();
+  memset(VINDENT, '\n', padding / 2); /* terminal fonts usually have 2:1 proportions */
   memset(INDENT, ' ', padding);
 
-  if (optind == argc) {
-    printf("%s", VINDENT);
-    tabs_abc(stdin, instr, transpose);
+  if (recommending || retuning) {
+    struct hist h;
+    int i;
+    memset(&h, 0, sizeof(h));
+    if (optind == argc) hist_abc(stdin, &h);
+    for (i = optind; i < argc; i++) {
+      FILE *f = fopen(argv[i], "r");
+      if (f == NULL) {
+        perror("fopen");
+        return 1;
+      }
+      hist_abc(f, &h);
+      fclose(f);
+    }
+    outs(VINDENT);
+    if (retuning) {
+      retune((struct frets *)instr->ctx, &h);
+    } else {
+      recommend(&h);
+    }
+    return 0;
+  }
+
+  if (indexdir) return index_dir(indexdir) < 0;
+  if (query) return index_search(optind < argc ? argv[optind] : ".", query) < 0;
+  if (packfile) return pack_files(packfile, argc - optind, argv + optind) < 0;
+  if (archive && autoharp) {
+    fprintf(stderr, "%s: -g needs a harmonica key, not auto\n", argv[0]);
+    return 1;
+  }
+
+  if (viewing) {
+    FILE *f = stdin;
+    if (!isatty(STDOUT_FILENO) || wavfile || archive || format != ANSI || argc - optind > 1) {
+      fprintf(stderr, "%s: -v shows a single file on a terminal\n", argv[0]);
+      return 1;
+    }
+    if (optind < argc && (f = fopen(argv[optind], "r")) == NULL) {
+      perror("fopen");
+      return 1;
+    }
+    view(f, optind < argc ? argv[optind] : "stdin", instr, transpose, autoharp);
+    return 0;
+  }
+
+  if (wavfile) {
+    if (wav_open(&wav, wavfile, instr) < 0) {
+      perror("fopen");
+      return 1;
+    }
+    wavinstr.ctx = &wav;
+    memo_off = 1;
+    instr = &wavinstr;
+  }
+
+  if (archive) {
+    err = pack_render(archive, argc - optind, argv + optind, instr, transpose) < 0;
+  } else if (optind == argc) {
+    tabs_file(stdin, instr, transpose, autoharp);
   } else {
     int i;
     for (i = optind; i < argc; i++) {
@@ -1021,10 +4307,14 @@ int main(int argc, char *argv[]) {
         perror("fopen");
         return 1;
       }
-      printf("%s", VINDENT);
-      tabs_abc(f, instr, transpose);
+      tabs_file(f, instr, transpose, autoharp);
       fclose(f);
     }
   }
-  return 0;
+  if (wavfile) wav_close(&wav);
+  if (stats) {
+    fprintf(stderr, "Rendered lines cache: %ld hits, %ld misses, %lu bytes\n", memo_hits,
+            memo_misses, (unsigned long)memo_size);
+  }
+  return err;
 }